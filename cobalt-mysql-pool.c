@@ -19,19 +19,35 @@
 #define _DEFAULT_SOURCE
 #define _GNU_SOURCE
 
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include <inttypes.h>
 #include <string.h>
 #include <limits.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include <time.h>
 #include <endian.h>
 #include <mysql.h>
 #include "cobalt-mysql-pool.h"
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#if defined(DB_REACTOR)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
 static char *err_not_inited = "database library can not be initialized";
 static char *err_not_thread_safe = "database library is not thread-safe";
 static char *err_not_open = "database connection is closed";
@@ -40,28 +56,543 @@ static char *err_unknown = "unknown error or no error";
 static char *err_init_lib = "failed to initialize the database library";
 static char *err_init_mutex = "failed to initialize the mutex";
 static char *err_init_rwlock = "failed to initialize the rw-lock";
-static char *err_init_semaphore = "failed to initialize the semaphore";
+static char *err_init_cond = "failed to initialize the condition variable";
+static char *err_alloc = "memory allocation failed";
 static char *err_connect = "can not connect to the database";
 static char *err_reconnect = "can not reconnect to the database";
 static char *err_init = "the database is not initialized";
 static char *err_ping = "database ping was not successful";
 static char *err_mutex = "can not acquire the database mutex";
 static char *err_rwlock = "can not acquire the database rw-lock";
-static char *err_semaphore_wait = "semaphore wait error";
-static char *err_semaphore_post = "semaphore post error";
-static char *err_clock_gettime = "clock_gettime failed";
-static char *err_no_free_slot_bug = "no free slot found, this is a bug";
-static char *err_no_busy_slot_bug = "no busy slot found, this is a bug";
+static char *err_cond_wait = "condition variable wait error";
+static char *err_thread = "can not start a thread";
+static char *err_timeout = "timed out waiting for a database connection";
+static char *err_busy = "no database connection is available";
+static char *err_not_borrowed =
+    "the connection is not borrowed from the pool";
+static char *err_exists = "a database pool with this name already exists";
+static char *err_no_cache = "the statement cache is disabled";
+static char *err_prepare = "the statement can not be prepared";
+static char *err_queries_full = "too many registered queries";
+static char *err_fetch = "the rows can not be fetched";
+static char *err_nonblock =
+    "the non-blocking mode is not enabled or not supported";
+static char *err_query = "database query was not successful";
+static char *err_async_busy = "an operation is already running";
+#if defined(DB_REACTOR)
+static char *err_epoll = "the event loop failed";
+static char *err_pending = "the reactor has pending operations";
+#endif
 static char *err_last = NULL;
+
+/*
+ * protects the list of the pools and the creation of the default pool
+ * used by the `db_` functions without a pool argument
+ */
 static pthread_mutex_t db_mutex;
-static pthread_rwlock_t db_rw_lock;
-static sem_t db_sem;
 
 /*
- * access to these variables must be protected by the `db_mutex` mutex
+ * the registered queries, the first `db_queries_count` entries are set
+ * and never change, so they are read without a lock, new ones are added
+ * with the `db_queries_mutex` mutex locked
+ */
+static struct {
+    char *sql;
+    unsigned long length;
+} db_queries[DB_QUERIES_MAX];
+static atomic_uint db_queries_count = 0U;
+static pthread_mutex_t db_queries_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* the size of a cache line, used to keep the hot data apart */
+#define DB_CACHE_LINE (64U)
+
+/*
+ * the slot states
+ *
+ * SLOT_FREE   - in a free stack
+ * SLOT_BUSY   - borrowed
+ * SLOT_CACHED - returned, but kept aside for the thread which returned
+ *               it, any thread which finds the pool empty may steal it
+ * SLOT_RETURNING - being returned by `db_post_handle`, which owns it
+ */
+#define SLOT_FREE      (0)
+#define SLOT_BUSY      (1)
+#define SLOT_CACHED    (2)
+#define SLOT_RETURNING (3)
+
+/*
+ * the non-blocking operation running on a slot
+ *
+ * ASYNC_NONE  - no operation is running
+ * ASYNC_QUERY - the query is being sent and executed
+ * ASYNC_STORE - the result set of the query is being read
+ * ASYNC_PING  - the connection is being pinged
+ */
+#define ASYNC_NONE  (0)
+#define ASYNC_QUERY (1)
+#define ASYNC_STORE (2)
+#define ASYNC_PING  (3)
+
+/*
+ * the acquire deadlines on the CLOCK_MONOTONIC scale, DEADLINE_POLL
+ * means not waiting at all, DEADLINE_NONE means waiting forever
+ */
+#define DEADLINE_POLL (UINT64_C(0))
+#define DEADLINE_NONE (UINT64_MAX)
+
+/*
+ * a pool slot, it owns one connection
+ *
+ * a free slot is linked into one of the free stacks, the slot is owned
+ * by the thread which popped it from a stack or switched it from
+ * SLOT_CACHED to SLOT_BUSY until it is returned
+ */
+struct db_slot {
+    /* the connection, NULL until the slot is connected on demand */
+    _Atomic(MYSQL *) mysql_conn;
+
+    /* one of the SLOT_ states */
+    atomic_int state;
+
+    /* the index + 1 of the next slot in the free stack, 0 for none */
+    _Atomic uint32_t next;
+
+    /* the index of the slot in the `slots` of its pool */
+    unsigned int index;
+
+    /* the shard the slot returns to */
+    unsigned int shard;
+
+    /* 1 if only the DB_PRIO_INTERACTIVE borrowers may take the slot */
+    int reserved;
+
+    /* the pool of the slot */
+    struct db_pool *pool;
+
+    /* 1 if borrowed for DB_WRITE, for the read-your-writes window */
+    int for_write;
+
+    /* 1 if the borrow is counted in the `in_flight` of the pool */
+    int measured;
+
+    /*
+     * the number of borrows and the time of the last one, these are
+     * written only by the thread which owns the slot
+     */
+    uint64_t generation;
+    uint64_t acquired_ns;
+
+    /* the time the slot was returned last, for the idle timeout */
+    uint64_t released_ns;
+
+    /* the time of the last successful health check of the connection */
+    uint64_t checked_ns;
+
+    /* the time the connection is replaced at, for the maximum lifetime */
+    uint64_t retire_ns;
+
+    /*
+     * the running non-blocking operation, one of the ASYNC_ states, the
+     * return value of the last `mysql_*_start` or `mysql_*_cont` call
+     * and the result set of the last query which was not taken yet
+     */
+    int async_op;
+    int async_error;
+    MYSQL_RES *async_result;
+
+    /*
+     * 1 if `db_stream_query` left unread rows on the connection, it is
+     * replaced when the slot is returned
+     */
+    int streaming;
+
+    /*
+     * the per-borrow arena, `arena` is the block kept between the
+     * borrows and `arena_extra` are the blocks added when it was full,
+     * the newest one first, they are freed when the slot is returned
+     */
+    struct db_chunk *arena;
+    struct db_chunk *arena_extra;
+
+    /*
+     * the prepared statement cache, `stmts` has `stmt_cache_size`
+     * elements allocated on the first use and the first `stmt_count` of
+     * them are set, `stmt_clock` is advanced on every lookup, the
+     * statements were prepared on the server thread `stmt_thread_id`,
+     * when the connection reconnects the server forgets them
+     *
+     * `queries` has DB_QUERIES_MAX elements allocated on the first use,
+     * the statements of the registered queries indexed by their ids
+     */
+    struct db_stmt *stmts;
+    unsigned int stmt_count;
+    uint64_t stmt_clock;
+    unsigned long stmt_thread_id;
+    MYSQL_STMT **queries;
+} __attribute__((aligned(DB_CACHE_LINE)));
+
+/*
+ * a memory block of an arena, the first `used` bytes of its `size`
+ * bytes of `data` are allocated
+ */
+struct db_chunk {
+    struct db_chunk *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+};
+
+/*
+ * an entry of the thread caches of a pool, on its own cache line, so
+ * the threads do not disturb each other
+ */
+struct db_cached {
+    struct db_slot *_Atomic slot;
+} __attribute__((aligned(DB_CACHE_LINE)));
+
+/*
+ * a cached prepared statement, `used` orders the statements of a slot
+ * from the least recently used one
+ */
+struct db_stmt {
+    MYSQL_STMT *stmt;
+    char *sql;
+    unsigned long length;
+    uint64_t hash;
+    uint64_t used;
+};
+
+/*
+ * a lock-free LIFO stack of slots
+ *
+ * the low 32 bits of `head` are the index + 1 of the top slot (0 for an
+ * empty stack) and the high 32 bits are a counter which is incremented
+ * on every change, so a compare-and-swap can not succeed on a head
+ * which was popped and pushed back in the meantime (the ABA problem)
+ */
+struct db_stack {
+    _Atomic uint64_t head;
+} __attribute__((aligned(DB_CACHE_LINE)));
+
+/*
+ * a part of the pool used by the threads running on some of the CPUs
+ * (or NUMA nodes)
+ */
+struct db_shard {
+    struct db_stack free;
+} __attribute__((aligned(DB_CACHE_LINE)));
+
+/*
+ * a thread waiting for a connection, it lives on the stack of that
+ * thread and is linked into the wait queue while it waits
+ *
+ * `slot` is set by the thread which hands a connection over, the
+ * waiter is removed from the queue at the same time
+ *
+ * a waiter can also be a part of a reactor operation, then `op` is set
+ * and it is notified through the reactor instead of `cond`
+ */
+struct db_op;
+
+struct db_waiter {
+    struct db_waiter *next;
+    struct db_waiter *prev;
+    pthread_cond_t cond;
+    struct db_op *op;
+    struct db_slot *slot;
+    unsigned int shard;
+    int grow;
+    int priority;
+};
+
+/*
+ * a pool of connections to one server with one set of settings
+ */
+struct db_pool {
+    /* the next pool in the `db_pools` list */
+    struct db_pool *next;
+
+    /* the name given to `db_pool_create`, NULL for an unnamed pool */
+    char *name;
+
+    /*
+     * the unique id of the pool, the thread caches refer to their pool
+     * by it, so a destroyed pool is never mistaken for a new one
+     */
+    uint64_t id;
+
+    /*
+     * a private copy of the settings, used to establish the
+     * connections on demand, it does not change while the pool exists
+     */
+    struct db_config cfg;
+
+    /*
+     * 1 if the load of the pool is measured, which is done for the
+     * replicas only, so the other pools do not pay for it
+     */
+    atomic_int measured;
+
+    /*
+     * `mutex` serializes opening and closing the pool
+     *
+     * changes to `is_open` and `is_closed` must be protected by the
+     * `rw_lock` read-write lock, the `db_pool_get_conn` function only
+     * needs `is_open` and reads it without the lock
+     *
+     * `is_open` = 0, `is_closed` = 1
+     * the mode after a successful call to `db_pool_close`
+     *
+     * `is_open` = 1, `is_closed` = 0
+     * normal operation mode
+     *
+     * `is_open` = 0, `is_closed` = 0
+     * not explicitly closed, but the connection was lost during the
+     * execution
+     *
+     * `is_open` = 1, `is_closed` = 1
+     * should be impossible
+     */
+    pthread_mutex_t mutex;
+    pthread_rwlock_t rw_lock;
+    atomic_int is_open;
+    volatile int is_closed;
+
+    /*
+     * 1 once `db_pool_close` has got all the connections back, so
+     * nobody uses the pool anymore, a failed close leaves it 0 and the
+     * next close drains again, it is protected by `mutex`
+     */
+    int is_drained;
+
+    /*
+     * the background warm-up thread of the DB_WARMUP_BACKGROUND mode
+     *
+     * `warm_running` is protected by `mutex`, the thread sleeps on
+     * `warm_cond` between the attempts to connect
+     */
+    pthread_mutex_t warm_mutex;
+    pthread_cond_t warm_cond;
+    pthread_t warm_thread;
+    int warm_running;
+
+    /*
+     * the maintenance thread which checks the idle connections every
+     * `health_interval_ms` milliseconds, it is started and stopped the
+     * same way as the warm-up thread
+     *
+     * `check_buf` has `conns_max` elements and is used only by that
+     * thread
+     */
+    pthread_mutex_t maint_mutex;
+    pthread_cond_t maint_cond;
+    pthread_t maint_thread;
+    int maint_running;
+    struct db_slot **check_buf;
+
+    /*
+     * there are `conns_max` slots and `shards_max` shards
+     *
+     * every free slot is either in the `free` stack of its shard if it
+     * is connected or in `conns_empty` if it waits to be connected on
+     * demand, except for the first `reserved_conns` slots which are
+     * always in `conns_reserved`
+     */
+    struct db_slot *slots;
+
+    /*
+     * the thread caches, `conns_max` entries, a thread keeps the slot
+     * it returned last in the entry of its `thread_number`, an entry
+     * may be stale, the slot may have been stolen or taken back since,
+     * so only the SLOT_CACHED state of the slot tells if it is there
+     */
+    struct db_cached *cached;
+    unsigned int conns_max;
+    struct db_shard *shards;
+    unsigned int shards_max;
+    struct db_stack conns_empty;
+    struct db_stack conns_reserved;
+
+    /*
+     * `conns_waiters` counts the threads in the wait queue (and
+     * `db_pool_close` while it drains the pool), it is written only on
+     * that slow path, the threads which return connections read it to
+     * decide whether they have to hand the connection over or may keep
+     * it in their cache, and the threads which borrow connections read
+     * it to queue up behind the waiting ones instead of overtaking them
+     */
+    atomic_uint conns_waiters __attribute__((aligned(DB_CACHE_LINE)));
+
+    /*
+     * the number of the threads inside `slot_acquire`, `db_pool_close`
+     * waits for it to drop to zero, so nobody who saw the pool open
+     * can take a slot after the pool was drained
+     */
+    atomic_uint acquirers;
+
+    /*
+     * the wait queue, it is ordered by the priority and then by the
+     * time of arrival, the waiter at the head gets the next returned
+     * connection, it is protected by `wait_mutex` and so is
+     * `wait_drain`, the condition variable `db_pool_close` sleeps on
+     */
+    pthread_mutex_t wait_mutex;
+    pthread_cond_t wait_drain;
+    struct db_waiter *wait_head;
+    struct db_waiter *wait_tail;
+
+    /*
+     * the number of connected slots, it changes only when a slot gets
+     * connected or disconnected
+     */
+    atomic_uint conns_connected __attribute__((aligned(DB_CACHE_LINE)));
+
+    /*
+     * the time of the next idle connections check, the thread which
+     * advances it does the check, `reap_running` is set during the
+     * check, so a slow one is never overlapped by the next one
+     *
+     * `reap_buf` has `conns_max` elements and is used only by the
+     * thread which holds `reap_running`
+     */
+    _Atomic uint64_t reap_next_ns;
+    atomic_flag reap_running;
+    struct db_slot **reap_buf;
+
+    /*
+     * the replicas the DB_READ borrowers are sent to, the first
+     * `replicas_count` pointers are set and never change, so they are
+     * read without a lock, new ones are added with the `db_mutex`
+     * mutex locked, `replica_next` picks the replica to wait on
+     *
+     * `primary` is the pool this one is a replica of, if any, it is
+     * protected by the `db_mutex` mutex
+     */
+    struct db_pool *replicas[DB_POOL_REPLICAS_MAX];
+    atomic_uint replicas_count;
+    atomic_uint replica_next;
+    struct db_pool *primary;
+
+    /*
+     * the load of a measured pool, the number of the borrowed
+     * connections and an exponentially weighted moving average of the
+     * time they are borrowed for
+     */
+    atomic_uint in_flight __attribute__((aligned(DB_CACHE_LINE)));
+    _Atomic uint64_t latency_ns;
+} __attribute__((aligned(DB_CACHE_LINE)));
+
+#if defined(DB_REACTOR)
+
+/*
+ * the kinds of the reactor operations
+ *
+ * OP_ACQUIRE - borrowing a connection from a pool
+ * OP_ASYNC   - a non-blocking operation on a borrowed handle
+ */
+#define OP_ACQUIRE (0)
+#define OP_ASYNC   (1)
+
+/*
+ * a pending reactor operation
+ *
+ * an OP_ACQUIRE operation which has to wait is queued in its pool
+ * through `waiter` like a thread is, but whoever hands a connection
+ * over to it or wakes it up puts it to the `ready` list of the reactor
+ * instead of signalling a condition variable
+ */
+struct db_op {
+    /* in the `ops` list of the reactor */
+    struct db_op *next;
+    struct db_op *prev;
+
+    /* in the `ready` list of the reactor while `ready` is 1 */
+    struct db_op *ready_next;
+    int ready;
+
+    struct db_reactor *reactor;
+    int kind;
+
+    /*
+     * OP_ACQUIRE, `queued` is 1 while `waiter` is counted in the
+     * `conns_waiters` of the pool, these and `waiter.grow` are changed
+     * by the reactor thread only
+     */
+    struct db_pool *pool;
+    struct db_waiter waiter;
+    int queued;
+    uint64_t grow_ns;
+    db_acquire_cb acquire_cb;
+
+    /*
+     * OP_ASYNC, the socket is in the epoll set while `fd` is not
+     * negative, `status` is the last value a `db_async_` function
+     * returned
+     */
+    db_handle_t *handle;
+    int fd;
+    int status;
+    db_done_cb done_cb;
+
+    /* when the waiting gives up or DB_ASYNC_TIMEOUT happens */
+    uint64_t deadline_ns;
+
+    void *arg;
+};
+
+struct db_reactor {
+    int epoll_fd;
+
+    /* becomes readable when an operation is added to `ready` */
+    int event_fd;
+
+    /* expires at `timer_ns`, DEADLINE_NONE when it is disarmed */
+    int timer_fd;
+    uint64_t timer_ns;
+
+    /* all the pending operations */
+    struct db_op *ops;
+    unsigned int pending;
+
+    /*
+     * the operations with something to do, any thread can add to the
+     * list, so it and the `ready` flags are protected by `ready_mutex`
+     */
+    pthread_mutex_t ready_mutex;
+    struct db_op *ready_head;
+    struct db_op *ready_tail;
+};
+
+#endif /* DB_REACTOR */
+
+/*
+ * all the existing pools and the id of the next one, protected by the
+ * `db_mutex` mutex
+ */
+static struct db_pool *db_pools = NULL;
+static uint64_t db_pool_next_id = 1U;
+
+/*
+ * the pool of the `db_` functions without a pool argument, created by
+ * the first successful `db_open_config` call, it is written only with
+ * the `db_mutex` mutex locked and never changes after that
+ */
+static struct db_pool *_Atomic db_default = NULL;
+
+/*
+ * the time the current thread returned its last DB_WRITE connection and
+ * the id of the pool it came from, for the read-your-writes window
+ */
+static __thread uint64_t thread_write_ns = 0U;
+static __thread uint64_t thread_write_pool_id = 0U;
+
+/*
+ * every thread gets a number once, round-robin, it picks the entry of
+ * the thread cache of a pool and the shard where the CPU number is not
+ * available, `thread_num` is that number + 1
  */
-static MYSQL *volatile mysql_conns[DB_POOL_CONN_COUNT] = {NULL};
-static volatile int mysql_conns_busy[DB_POOL_CONN_COUNT] = {0};
+static __thread unsigned int thread_num = 0U;
+static atomic_uint thread_num_next = 0U;
 
 /*
  * `is_thread_safe` = 0
@@ -76,448 +607,5396 @@ static volatile int is_thread_safe = 0;
 static volatile int is_inited = 0;
 
 /*
- * access to these variables must be protected by the `db_rwlock`
- * read-write lock
+ * initialize the database library and the `db_mutex` mutex, only the
+ * first successful call does anything
+ *
+ * returns zero on success or a negative value on error
+ */
+static int lib_init(void);
+
+/*
+ * open a pool, i.e. connect it for the first time or check the
+ * existing connections if it was closed
+ *
+ * returns zero on success or a negative value on error
+ */
+static int pool_open(struct db_pool *pool, int is_first);
+
+/*
+ * close a pool and wait until all its connections are returned, it must
+ * be called with the `mutex` mutex of the pool locked
+ *
+ * returns zero on success or a negative value on error
+ */
+static int pool_close(struct db_pool *pool);
+
+/*
+ * free a pool which was closed or never opened, its connections are
+ * closed
+ */
+static void pool_free(struct db_pool *pool);
+
+/*
+ * allocate a pool with a copy of `config` and open it
+ *
+ * returns NULL on error
+ */
+static struct db_pool *pool_create(const char *name,
+        const struct db_config *config);
+
+/*
+ * give the pool its id and add it to the `db_pools` list, it must be
+ * called with the `db_mutex` mutex locked
+ */
+static void pool_link(struct db_pool *pool);
+
+/*
+ * find a pool by its name, it must be called with the `db_mutex` mutex
+ * locked
+ *
+ * returns NULL if there is no such pool
+ */
+static struct db_pool *pool_find(const char *name);
+
+/*
+ * find the slot of a connection borrowed from `pool` or from one of
+ * its replicas
+ *
+ * returns NULL if there is no such slot
+ */
+static struct db_slot *pool_find_slot(struct db_pool *pool,
+        MYSQL *mysql_conn);
+
+/*
+ * get the load score of a measured pool, the expected time until a new
+ * borrower is done, the lower the better
+ */
+static uint64_t pool_score(struct db_pool *pool);
+
+/*
+ * convert a timeout of the `db_pool_get_handle_` functions to a
+ * deadline
+ */
+static uint64_t deadline_from(uint64_t timeout_ns);
+
+/*
+ * get the pool of the `db_` functions without a pool argument
  *
- * `is_open` = 0, `is_closed` = 1
- * initial mode or the mode after successful call to `db_close`
+ * returns NULL if it does not exist yet
+ */
+static struct db_pool *pool_default(void);
+
+/*
+ * copy the strings of `src` to `dst`
+ *
+ * returns zero on success or a negative value on error
+ */
+static int config_copy(struct db_config *dst, const struct db_config *src);
+
+/*
+ * free the strings copied by `config_copy`
+ */
+static void config_free(struct db_config *config);
+
+/*
+ * create a new connection using the settings of the pool
+ *
+ * returns NULL on error
+ */
+static MYSQL *conn_open(struct db_pool *pool);
+
+/*
+ * connect an empty slot owned by the caller
+ *
+ * returns zero on success or a negative value on error
+ */
+static int slot_connect(struct db_slot *slot);
+
+/*
+ * close the connection of a slot owned by the caller
+ */
+static void slot_disconnect(struct db_slot *slot);
+
+/*
+ * get the prepared statement for the `length` bytes of `sql` with the
+ * `hash` hash from the cache of `slot`, preparing it if it is not
+ * there
  *
- * `is_open` = 1, `is_closed` = 0
- * normal operation mode
+ * returns NULL on error
+ */
+static MYSQL_STMT *slot_stmt(struct db_slot *slot, const char *sql,
+        unsigned long length, uint64_t hash);
+
+/*
+ * get the prepared statement of the registered query `id` from `slot`,
+ * preparing it if it is not there
  *
- * `is_open` = 0, `is_closed` = 0
- * not explicitly closed, but the connection was lost during the execution
+ * returns NULL on error
+ */
+static MYSQL_STMT *slot_query(struct db_slot *slot, unsigned int id);
+
+/*
+ * prepare all the registered queries on the newly connected `slot`
+ */
+static void slot_queries_prepare(struct db_slot *slot);
+
+/*
+ * empty the statement caches of `slot` if its connection has
+ * reconnected since the statements were prepared
+ */
+static void slot_stmts_sync(struct db_slot *slot, MYSQL *mysql_conn);
+
+/*
+ * close the cached statements of `slot`
+ */
+static void slot_stmts_free(struct db_slot *slot);
+
+/*
+ * end the unfinished streamed result set `res` of `slot`, reading the
+ * rest of it if it is short, or closing the socket, so `res` can be
+ * freed at once, and leaving the slot to be replaced when it is
+ * returned
+ */
+static void slot_stream_abort(struct db_slot *slot, MYSQL_RES *res);
+
+/*
+ * allocate a new arena block for at least `size` bytes
  *
- * `is_open` = 1, `is_closed` = 1
- * should be impossible
+ * returns NULL on error
+ */
+static struct db_chunk *chunk_new(size_t size);
+
+/*
+ * free the blocks added to the arena of `slot` and empty the one it
+ * keeps
+ */
+static void slot_arena_reset(struct db_slot *slot);
+
+/*
+ * move the `buffer`, `length`, `is_null` and `error` pointers of the
+ * `columns` elements of `bind` by `offset` bytes
+ */
+static void bind_move(MYSQL_BIND *bind, unsigned int columns,
+        ptrdiff_t offset);
+
+/*
+ * get the FNV-1a hash of the `length` bytes of `data`
  */
-static volatile int is_open = 0;
-static volatile int is_closed = 1;
+static uint64_t hash_fnv1a(const char *data, unsigned long length);
+
+/*
+ * get for how long the connection of `slot` has not been used or
+ * checked at the time `now`
+ */
+static uint64_t slot_idle_ns(const struct db_slot *slot, uint64_t now);
+
+/*
+ * ping the connection of `slot`, which must be connected, and replace
+ * it with a new one if the ping fails, the slot must be owned by the
+ * calling thread
+ *
+ * returns zero on success or a negative value if the slot was left
+ * disconnected
+ */
+static int slot_check(struct db_slot *slot);
+
+/*
+ * replace the connection of `slot`, which must be connected, with a new
+ * one, the slot must be owned by the calling thread
+ *
+ * returns zero on success or a negative value if the slot was left
+ * disconnected
+ */
+static int slot_renew(struct db_slot *slot);
+
+/*
+ * scramble the bits of `x`, it is used for the lifetime jitter
+ */
+static uint64_t mix64(uint64_t x);
+
+#if defined(MYSQL_WAIT_READ)
+
+/*
+ * check a non-blocking operation can be started on `slot`
+ *
+ * returns zero on success or a negative value on error
+ */
+static int async_check(const struct db_slot *slot);
+
+/*
+ * advance the operation running on `slot` after a `mysql_*_start` or
+ * `mysql_*_cont` call returned `status`, a completed query goes on
+ * with reading its result set
+ *
+ * returns the events to wait for, zero on completion or a negative
+ * value on error
+ */
+static int async_next(struct db_slot *slot, int status);
+
+#endif /* MYSQL_WAIT_READ */
+
+#if defined(DB_REACTOR)
+
+/*
+ * close the descriptors of `reactor` and free it
+ */
+static void reactor_free(struct db_reactor *reactor);
+
+/*
+ * arm the timer of `reactor` for the earliest deadline of its
+ * operations
+ *
+ * returns zero on success or a negative value on error
+ */
+static int reactor_arm(struct db_reactor *reactor);
+
+/*
+ * process the operations in the `ready` list of `reactor`
+ *
+ * returns the number of the called callbacks
+ */
+static int reactor_ready(struct db_reactor *reactor);
+
+/*
+ * process the operations of `reactor` whose deadlines have passed
+ *
+ * returns the number of the called callbacks
+ */
+static int reactor_expire(struct db_reactor *reactor);
+
+/*
+ * allocate a new operation and add it to `reactor`
+ *
+ * returns NULL on error
+ */
+static struct db_op *op_new(struct db_reactor *reactor, int kind,
+        void *arg);
+
+/*
+ * remove `op` from its reactor and free it
+ */
+static void op_free(struct db_op *op);
+
+/*
+ * add `op` to the `ready` list of its reactor and wake the reactor up,
+ * it can be called from any thread
+ */
+static void op_ready(struct db_op *op);
+
+/*
+ * take `op` out of the wait queue of its pool, the `wait_mutex` mutex
+ * of the pool must be locked and `waiter` must not be queued anymore
+ */
+static void op_leave(struct db_op *op);
+
+/*
+ * finish an OP_ACQUIRE operation which is ready, unless it has to wait
+ * more
+ *
+ * returns the number of the called callbacks
+ */
+static int op_acquire(struct db_op *op);
+
+/*
+ * start or continue an OP_ASYNC operation with the value a `db_async_`
+ * function returned and call its callback if it has completed
+ *
+ * returns the number of the called callbacks
+ */
+static int op_async(struct db_op *op, int status);
+
+/*
+ * start the non-blocking operation `status` was returned for
+ *
+ * returns zero on success or a negative value on error
+ */
+static int op_async_start(struct db_op *op, int status);
+
+/*
+ * read the counter of an eventfd or a timerfd descriptor to reset it
+ */
+static void fd_drain(int fd);
+
+#endif /* DB_REACTOR */
+
+/*
+ * the state shared by the threads of `conn_open_batch`
+ */
+struct conn_batch {
+    /* the pool of the slots */
+    struct db_pool *pool;
+
+    /* the index of the next slot to connect */
+    atomic_uint next;
+
+    /* the number of slots to connect */
+    unsigned int count;
+
+    /* set to 1 by the first thread which fails to connect */
+    atomic_int failed;
+
+    /* if 1, a failure does not stop the others */
+    int tolerant;
+};
+
+/*
+ * connect the first `count` slots using up to `connect_threads`
+ * threads at once, either all of them get connected or none, unless
+ * `tolerant` is 1, then the slots which fail stay empty
+ *
+ * returns zero on success or a negative value on error
+ */
+static int conn_open_batch(struct db_pool *pool, unsigned int count,
+        int tolerant);
+
+/*
+ * the body of a `conn_open_batch` thread, `arg` is the `conn_batch`
+ */
+static void *conn_open_batch_run(void *arg);
+
+/*
+ * start the warm-up thread if the DB_WARMUP_BACKGROUND mode is used,
+ * it must be called with the `mutex` mutex of the pool locked
+ *
+ * returns zero on success or a negative value on error
+ */
+static int warm_start(struct db_pool *pool);
+
+/*
+ * stop the warm-up thread, it must be called with the `mutex` mutex of
+ * the pool locked and `is_open` set to 0
+ */
+static void warm_stop(struct db_pool *pool);
+
+/*
+ * the body of the warm-up thread, it connects the empty reserved slots
+ * and then empty slots until `min_conns` slots are connected or the
+ * pool is closed, `arg` is the pool
+ */
+static void *warm_run(void *arg);
+
+/*
+ * connect the empty reserved slots which are free, a failed one stays
+ * empty and is tried again by the next call
+ *
+ * returns zero on success or a negative value if a connection failed
+ */
+static int warm_reserved(struct db_pool *pool);
+
+/*
+ * start the maintenance thread if `health_interval_ms` is set, it must
+ * be called with the `mutex` mutex of the pool locked
+ *
+ * returns zero on success or a negative value on error
+ */
+static int maint_start(struct db_pool *pool);
+
+/*
+ * stop the maintenance thread, it must be called with the `mutex`
+ * mutex of the pool locked and `is_open` set to 0
+ */
+static void maint_stop(struct db_pool *pool);
+
+/*
+ * the body of the maintenance thread, it checks the idle connections
+ * every `health_interval_ms` milliseconds until the pool is closed,
+ * `arg` is the pool
+ */
+static void *maint_run(void *arg);
+
+/*
+ * push `slot` to the top of `stack`
+ */
+static void stack_push(struct db_stack *stack, struct db_slot *slot);
+
+/*
+ * pop the top slot of `stack`
+ *
+ * returns NULL if the stack is empty
+ */
+static struct db_slot *stack_pop(struct db_pool *pool,
+        struct db_stack *stack);
+
+/*
+ * take all the slots out of `stack` at once and store them to `buf`,
+ * the top one first, the other threads see an empty stack until the
+ * slots are pushed back
+ *
+ * returns the number of slots
+ */
+static unsigned int stack_detach(struct db_pool *pool,
+        struct db_stack *stack, struct db_slot **buf);
+
+/*
+ * get the current CLOCK_MONOTONIC time in nanoseconds
+ */
+static uint64_t now_ns(void);
+
+/*
+ * initialize a condition variable which uses CLOCK_MONOTONIC for the
+ * timed waits
+ *
+ * returns zero on success or a non-zero value on error
+ */
+static int cond_init_monotonic(pthread_cond_t *cond);
+
+/*
+ * convert CLOCK_MONOTONIC nanoseconds to a timespec
+ */
+static struct timespec ns_to_timespec(uint64_t ns);
+
+/*
+ * switch a slot from SLOT_CACHED to SLOT_BUSY
+ *
+ * returns 1 if the slot is ours now, 0 if it was not cached
+ */
+static int slot_uncache(struct db_slot *slot);
+
+/*
+ * put a slot owned by the caller to its free stack and wake up a
+ * waiting thread if there is any
+ *
+ * returns zero on success or a negative value on error
+ */
+static int slot_release(struct db_slot *slot);
+
+/*
+ * get the free stack a slot belongs to
+ */
+static struct db_stack *slot_stack(struct db_slot *slot);
+
+/*
+ * steal a connection cached by any thread
+ *
+ * returns NULL if there is none
+ */
+static struct db_slot *slot_steal(struct db_pool *pool);
+
+/*
+ * take a free slot without waiting, first from the `shard` shard, then
+ * from the neighbouring shards, then a cached one, then, if `grow` is
+ * 1 or the pool has too few connections, an empty one to be connected
+ * and at last a reserved one if the `priority` allows it, the slot is
+ * switched to SLOT_BUSY
+ *
+ * returns NULL if there is no such slot
+ */
+static struct db_slot *slot_get(struct db_pool *pool, unsigned int shard,
+        int grow, int priority);
+
+/*
+ * borrow a slot for a `db_get_handle_` function, waiting until
+ * `deadline_ns` at most, `busy` (if it is not NULL) is set to 1 when
+ * DEADLINE_POLL found no free slot and to 0 otherwise, so the callers
+ * do not need to compare the shared `err_last`
+ *
+ * returns NULL on error
+ */
+static struct db_slot *slot_acquire(struct db_pool *pool,
+        uint64_t deadline_ns, int priority, int *busy);
+
+/*
+ * the part of `slot_acquire` which takes a slot, the caller is counted
+ * in `acquirers`, the slot is released again if the pool was closed in
+ * the meantime
+ *
+ * returns NULL on error
+ */
+static struct db_slot *slot_take(struct db_pool *pool,
+        uint64_t deadline_ns, int priority, int *busy);
+
+/*
+ * finish borrowing `slot`, connect it if it is empty, check it if it is
+ * idle for too long and do the bookkeeping, the slot is released on
+ * error
+ *
+ * returns NULL on error
+ */
+static struct db_slot *slot_ready(struct db_pool *pool,
+        struct db_slot *slot);
+
+/*
+ * wait in the queue until a slot is handed over to us, the pool gets
+ * closed or `deadline_ns` passes, the pool may grow after
+ * `grow_wait_ms` milliseconds of waiting
+ *
+ * returns NULL on error
+ */
+static struct db_slot *slot_wait(struct db_pool *pool, unsigned int shard,
+        uint64_t deadline_ns, int priority);
+
+/*
+ * close the connections which are idle longer than `idle_timeout_ms`,
+ * keeping at least `min_conns` connected
+ */
+static void slots_reap(struct db_pool *pool, uint64_t now);
+
+/*
+ * call `slots_reap` if the time of the next check has come and no
+ * other thread does it already
+ */
+static void slots_reap_due(struct db_pool *pool, uint64_t now);
+
+/*
+ * ping the free connections which are idle at least
+ * `health_interval_ms` milliseconds and replace the ones older than
+ * `max_lifetime_ms`, the broken ones are reconnected or left empty to
+ * be connected on demand
+ */
+static void slots_check(struct db_pool *pool, uint64_t now);
+
+/*
+ * do the `slots_check` work for the slots in `stack`
+ */
+static void slots_check_stack(struct db_pool *pool, struct db_stack *stack,
+        uint64_t now);
+
+/*
+ * hand the free slots over to the waiting threads in the order of
+ * their arrival, or wake all of them up if the pool is not open
+ */
+static void slot_wake(struct db_pool *pool);
+
+/*
+ * hand a returned slot directly over to the first waiting thread
+ *
+ * returns 1 if the slot was handed over or 0 if nobody takes it
+ */
+static int slot_handoff(struct db_slot *slot);
+
+/*
+ * add a waiter to the wait queue behind the waiters of the same or
+ * higher priority or remove it, these must be called with the
+ * `wait_mutex` mutex locked
+ */
+static void waiter_enqueue(struct db_pool *pool,
+        struct db_waiter *waiter);
+static void waiter_dequeue(struct db_pool *pool,
+        struct db_waiter *waiter);
+
+/*
+ * wake `waiter` up, the `wait_mutex` mutex of its pool must be locked
+ */
+static void waiter_notify(struct db_waiter *waiter);
+
+/*
+ * get the shard of the calling thread by its CPU (or NUMA node)
+ */
+static unsigned int shard_current(struct db_pool *pool);
+
+/*
+ * get the number of the calling thread, see `thread_num`
+ */
+static unsigned int thread_number(void);
+
+/*
+ * get the thread cache entry of the calling thread in `pool`
+ */
+static struct db_cached *thread_cached(struct db_pool *pool);
+
+/*
+ * take the cached slots which were not used for `idle_ns` nanoseconds
+ * or whose connection is past its lifetime back to the free stacks, so
+ * the threads which stopped borrowing do not keep them from the checks
+ */
+static void slots_uncache_stale(struct db_pool *pool, uint64_t now,
+        uint64_t idle_ns);
+
+/*
+ * get the default number of shards, the number of online CPUs (or NUMA
+ * nodes)
+ */
+static unsigned int shard_default_count(int by_node);
+
+/*
+ * allocate and initialize `count` shards
+ *
+ * returns zero on success or a negative value on error
+ */
+static int shards_init(struct db_pool *pool, unsigned int count);
+
+/*
+ * destroy the shards allocated by `shards_init`
+ */
+static void shards_free(struct db_pool *pool);
+
+/*
+ * please check the functions comments in the header file
+ */
+
+void db_thread_init(void)
+{
+    mysql_thread_init();
+}
+
+void db_thread_end(void)
+{
+    struct db_pool *pool;
+    struct db_slot *slot;
+
+    /*
+     * the connections kept aside by this thread are of no use anymore
+     */
+    if (thread_num && is_inited && pthread_mutex_lock(&db_mutex) == 0) {
+        for (pool = db_pools; pool; pool = pool->next) {
+            if (!pool->cfg.thread_cache) {
+                continue;
+            }
+
+            slot = atomic_exchange(&thread_cached(pool)->slot, NULL);
+            if (slot && slot_uncache(slot)) {
+                slot_release(slot);
+            }
+        }
+
+        pthread_mutex_unlock(&db_mutex);
+    }
+
+    mysql_thread_end();
+}
+
+const char *db_error(void)
+{
+    struct db_pool *pool;
+
+    if (err_last) {
+        return err_last;
+    }
+
+    if (!is_thread_safe) {
+        return err_not_thread_safe;
+    }
+
+    if (!is_inited) {
+        return  err_not_inited;
+    }
+
+    pool = atomic_load_explicit(&db_default, memory_order_acquire);
+    if (!pool) {
+        return err_not_open;
+    }
+
+    if (pthread_rwlock_rdlock(&pool->rw_lock) != 0) {
+        return err_rwlock;
+    }
+
+    if (!pool->is_open) {
+        pthread_rwlock_unlock(&pool->rw_lock);
+        return err_not_open;
+    }
+
+    pthread_rwlock_unlock(&pool->rw_lock);
+
+    return err_unknown;
+}
+
+void db_config_init(struct db_config *config)
+{
+    memset(config, 0, sizeof(*config));
+
+    config->autocommit_mode = 1;
+    config->min_conns = DB_POOL_CONN_COUNT;
+    config->max_conns = DB_POOL_CONN_COUNT;
+    config->thread_cache = 0;
+    config->shards = 0U;
+    config->shard_by_node = 0;
+    config->connect_threads = DB_CONNECT_THREADS;
+    config->warmup = DB_WARMUP_EAGER;
+    config->grow_wait_ms = 0U;
+    config->idle_timeout_ms = 0U;
+    config->health_interval_ms = 0U;
+    config->validate_idle_ms = 0U;
+    config->max_lifetime_ms = 0U;
+    config->nonblock = 0;
+    config->stmt_cache_size = DB_STMT_CACHE_SIZE;
+    config->prepare_queries = 0;
+    config->stream_drain_rows = DB_STREAM_DRAIN_ROWS;
+    config->arena_size = DB_ARENA_SIZE;
+    config->reserved_conns = 0U;
+    config->rw_window_ms = 0U;
+}
+
+int db_open(const char *host,
+            const char *user,
+            const char *passwd,
+            const char *db,
+            unsigned int port,
+            const char *unix_socket,
+            unsigned long client_flag,
+            my_bool autocommit_mode)
+{
+    struct db_config config;
+
+    db_config_init(&config);
+
+    config.host = host;
+    config.user = user;
+    config.passwd = passwd;
+    config.db = db;
+    config.port = port;
+    config.unix_socket = unix_socket;
+    config.client_flag = client_flag;
+    config.autocommit_mode = autocommit_mode;
+
+    return db_open_config(&config);
+}
+
+int db_open_config(const struct db_config *config)
+{
+    struct db_pool *pool;
+
+    if (lib_init() != 0) {
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&db_mutex) != 0) {
+        err_last = err_mutex;
+        return -1;
+    }
+
+    /*
+     * the first successful call fixes the pool size and the connection
+     * settings, the following calls only re-check the existing
+     * connections
+     */
+    pool = atomic_load_explicit(&db_default, memory_order_relaxed);
+    if (!pool) {
+        pool = pool_create(NULL, config);
+        if (!pool) {
+            /* let the next call try again with its own settings */
+            pthread_mutex_unlock(&db_mutex);
+            return -1;
+        }
+
+        pool_link(pool);
+        atomic_store_explicit(&db_default, pool, memory_order_release);
+
+        pthread_mutex_unlock(&db_mutex);
+        return 0;
+    }
+
+    pthread_mutex_unlock(&db_mutex);
+
+    return db_pool_open(pool);
+}
+
+int db_close(void)
+{
+    struct db_pool *pool;
+
+    if (!is_inited) {
+        err_last = err_init;
+        return -1;
+    }
+
+    pool = atomic_load_explicit(&db_default, memory_order_acquire);
+    if (!pool) {
+        /* never opened, so it is closed */
+        return 0;
+    }
+
+    return db_pool_close(pool);
+}
+
+int db_is_open(void) {
+    struct db_pool *pool;
+
+    if (!is_inited) {
+        return 0;
+    }
+
+    pool = atomic_load_explicit(&db_default, memory_order_acquire);
+    if (!pool) {
+        return 0;
+    }
+
+    return db_pool_is_open(pool);
+}
+
+int db_is_closed(void)
+{
+    struct db_pool *pool;
+
+    if (!is_inited) {
+        return 1;
+    }
+
+    pool = atomic_load_explicit(&db_default, memory_order_acquire);
+    if (!pool) {
+        return 1;
+    }
+
+    return db_pool_is_closed(pool);
+}
+
+MYSQL *db_get_conn(void)
+{
+    return db_get_conn_prio(DB_PRIO_INTERACTIVE, DB_WAIT_FOREVER);
+}
+
+MYSQL *db_get_conn_timed(uint64_t timeout_ns)
+{
+    return db_get_conn_prio(DB_PRIO_INTERACTIVE, timeout_ns);
+}
+
+MYSQL *db_get_conn_prio(int priority, uint64_t timeout_ns)
+{
+    struct db_pool *pool;
+
+    pool = pool_default();
+    if (!pool) {
+        return NULL;
+    }
+
+    return db_pool_get_conn_prio(pool, priority, timeout_ns);
+}
+
+MYSQL *db_try_get_conn(void)
+{
+    return db_get_conn_prio(DB_PRIO_INTERACTIVE, 0U);
+}
+
+int db_post_conn(MYSQL *mysql_conn)
+{
+    struct db_pool *pool;
+
+    if (!is_inited) {
+        err_last = err_init;
+        return -1;
+    }
+
+    pool = atomic_load_explicit(&db_default, memory_order_acquire);
+    if (!pool) {
+        err_last = err_not_borrowed;
+        return -1;
+    }
+
+    return db_pool_post_conn(pool, mysql_conn);
+}
+
+db_handle_t *db_get_handle(void)
+{
+    return db_get_handle_prio(DB_PRIO_INTERACTIVE, DB_WAIT_FOREVER);
+}
+
+db_handle_t *db_get_handle_timed(uint64_t timeout_ns)
+{
+    return db_get_handle_prio(DB_PRIO_INTERACTIVE, timeout_ns);
+}
+
+db_handle_t *db_try_get_handle(void)
+{
+    return db_get_handle_prio(DB_PRIO_INTERACTIVE, 0U);
+}
+
+db_handle_t *db_get_handle_prio(int priority, uint64_t timeout_ns)
+{
+    struct db_pool *pool;
+
+    pool = pool_default();
+    if (!pool) {
+        return NULL;
+    }
+
+    return db_pool_get_handle_prio(pool, priority, timeout_ns);
+}
+
+MYSQL *db_get_conn_for(int mode)
+{
+    struct db_pool *pool;
+
+    pool = pool_default();
+    if (!pool) {
+        return NULL;
+    }
+
+    return db_pool_get_conn_for(pool, mode);
+}
+
+db_handle_t *db_get_handle_for(int mode)
+{
+    struct db_pool *pool;
+
+    pool = pool_default();
+    if (!pool) {
+        return NULL;
+    }
+
+    return db_pool_get_handle_for(pool, mode, DB_PRIO_INTERACTIVE,
+            DB_WAIT_FOREVER);
+}
+
+db_pool_t *db_pool_create(const char *name, const struct db_config *config)
+{
+    struct db_pool *pool;
+
+    if (lib_init() != 0) {
+        return NULL;
+    }
+
+    /*
+     * the connections are established without holding the `db_mutex`
+     * mutex, so the name is checked once more before the pool is
+     * added to the list
+     */
+    if (name && db_pool_find(name)) {
+        err_last = err_exists;
+        return NULL;
+    }
+
+    pool = pool_create(name, config);
+    if (!pool) {
+        return NULL;
+    }
+
+    if (pthread_mutex_lock(&db_mutex) != 0) {
+        db_pool_close(pool);
+        pool_free(pool);
+
+        err_last = err_mutex;
+        return NULL;
+    }
+
+    if (name && pool_find(name)) {
+        pthread_mutex_unlock(&db_mutex);
+
+        db_pool_close(pool);
+        pool_free(pool);
+
+        err_last = err_exists;
+        return NULL;
+    }
+
+    pool_link(pool);
+
+    pthread_mutex_unlock(&db_mutex);
+
+    return pool;
+}
+
+int db_pool_destroy(db_pool_t *pool)
+{
+    unsigned int i;
+    struct db_pool **link;
+
+    if (!is_inited) {
+        err_last = err_init;
+        return -1;
+    }
+
+    /* the default pool lives as long as the process */
+    if (!pool || pool == atomic_load(&db_default)) {
+        err_last = err_input;
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&db_mutex) != 0) {
+        err_last = err_mutex;
+        return -1;
+    }
+
+    for (link = &db_pools; *link && *link != pool; link = &(*link)->next) {
+    }
+
+    /* a replica has to stay while its primary uses it */
+    if (!*link || pool->primary) {
+        pthread_mutex_unlock(&db_mutex);
+
+        err_last = err_input;
+        return -1;
+    }
+
+    pthread_mutex_unlock(&db_mutex);
+
+    /*
+     * waits until all the connections are returned, then nobody else
+     * uses the pool anymore, if it fails the pool stays registered, so
+     * it can still be found, opened again or destroyed later
+     */
+    if (db_pool_close(pool) != 0) {
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&db_mutex) != 0) {
+        err_last = err_mutex;
+        return -1;
+    }
+
+    for (link = &db_pools; *link && *link != pool; link = &(*link)->next) {
+    }
+
+    /* it may have been made a replica while it was being closed */
+    if (!*link || pool->primary) {
+        pthread_mutex_unlock(&db_mutex);
+
+        err_last = err_input;
+        return -1;
+    }
+
+    *link = pool->next;
+
+    for (i = 0U; i < atomic_load(&pool->replicas_count); i++) {
+        pool->replicas[i]->primary = NULL;
+    }
+
+    pthread_mutex_unlock(&db_mutex);
+
+    pool_free(pool);
+
+    return 0;
+}
+
+db_pool_t *db_pool_find(const char *name)
+{
+    struct db_pool *pool;
+
+    if (!is_inited) {
+        err_last = err_init;
+        return NULL;
+    }
+
+    if (!name) {
+        err_last = err_input;
+        return NULL;
+    }
+
+    if (pthread_mutex_lock(&db_mutex) != 0) {
+        err_last = err_mutex;
+        return NULL;
+    }
+
+    pool = pool_find(name);
+
+    pthread_mutex_unlock(&db_mutex);
+
+    return pool;
+}
+
+db_pool_t *db_pool_default(void)
+{
+    return pool_default();
+}
+
+const char *db_pool_name(const db_pool_t *pool)
+{
+    return pool->name;
+}
+
+int db_pool_open(db_pool_t *pool)
+{
+    int result;
+
+    if (!is_inited) {
+        err_last = err_init;
+        return -1;
+    }
+
+    if (!pool) {
+        err_last = err_input;
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&pool->mutex) != 0) {
+        err_last = err_mutex;
+        return -1;
+    }
+
+    result = pool_open(pool, 0);
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return result;
+}
+
+int db_pool_close(db_pool_t *pool)
+{
+    int result;
+
+    if (!is_inited) {
+        err_last = err_init;
+        return -1;
+    }
+
+    if (!pool) {
+        err_last = err_input;
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&pool->mutex) != 0) {
+        err_last = err_mutex;
+        return -1;
+    }
+
+    result = pool->is_drained ? 0 : pool_close(pool);
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return result;
+}
+
+static int pool_close(struct db_pool *pool)
+{
+    size_t i;
+    unsigned int count;
+    int result = 0;
+    struct db_stack drained;
+    struct db_slot *slot;
+
+    if (pthread_rwlock_wrlock(&pool->rw_lock) != 0) {
+        err_last = err_rwlock;
+        return -1;
+    }
+
+    /*
+     * after this the `db_pool_get_conn` function won't return any more
+     * connections from the pool until `is_open` becomes 1
+     *
+     * by setting the `is_closed` to 1 we can inform the application
+     * the connections was closed intentionally and there is no need
+     * to reconnect
+     */
+    atomic_store(&pool->is_open, 0);
+    pool->is_closed = 1;
+
+    pthread_rwlock_unlock(&pool->rw_lock);
+
+    warm_stop(pool);
+    maint_stop(pool);
+
+    /*
+     * wake up the threads waiting for a connection, they will see the
+     * pool is not open anymore
+     */
+    slot_wake(pool);
+
+    /*
+     * take the cached connections back, a thread which caches a
+     * connection after this checks `is_open` and returns it by itself
+     */
+    for (i = 0U; i < pool->conns_max; i++) {
+        if (slot_uncache(&pool->slots[i]) &&
+                slot_release(&pool->slots[i]) != 0) {
+            return -1;
+        }
+    }
+
+    /*
+     * try to wait for all the connections from the pool that are being
+     * used, every free slot is moved to a private stack, so once we
+     * hold all `conns_max` slots and no thread is inside `slot_acquire`
+     * nothing is borrowed and nothing can be anymore
+     *
+     * no more connections will be returned from the pool by the
+     * `db_pool_get_conn` funtion until `db_pool_open` is called again
+     */
+    atomic_init(&drained.head, 0U);
+
+    if (pthread_mutex_lock(&pool->wait_mutex) != 0) {
+        err_last = err_mutex;
+        return -1;
+    }
+
+    /* counted, but not queued, so no connection is handed over to us */
+    atomic_fetch_add(&pool->conns_waiters, 1U);
+
+    for (count = 0U;;) {
+        for (i = 0U; i < pool->shards_max + 2U; i++) {
+            struct db_stack *stack = i < pool->shards_max ?
+                &pool->shards[i].free : (i == pool->shards_max ?
+                        &pool->conns_empty : &pool->conns_reserved);
+
+            while ((slot = stack_pop(pool, stack)) != NULL) {
+                stack_push(&drained, slot);
+                count++;
+            }
+        }
+
+        if (count == pool->conns_max && !atomic_load(&pool->acquirers)) {
+            break;
+        }
+
+        if (pthread_cond_wait(&pool->wait_drain, &pool->wait_mutex) != 0) {
+            err_last = err_cond_wait;
+            result = -1;
+            break;
+        }
+    }
+
+    atomic_fetch_sub(&pool->conns_waiters, 1U);
+
+    pthread_mutex_unlock(&pool->wait_mutex);
+
+    /*
+     * put everything back, the connections stay ready for the next
+     * `db_pool_open` call
+     */
+    while ((slot = stack_pop(pool, &drained)) != NULL) {
+        stack_push(slot_stack(slot), slot);
+    }
+
+    pool->is_drained = result == 0;
+
+    return result;
+}
+
+int db_pool_is_open(db_pool_t *pool)
+{
+    int result;
+
+    if (!pool) {
+        err_last = err_input;
+        return -1;
+    }
+
+    if (pthread_rwlock_rdlock(&pool->rw_lock) != 0) {
+        err_last = err_rwlock;
+        return -1;
+    }
+
+    result = pool->is_open;
+
+    pthread_rwlock_unlock(&pool->rw_lock);
+
+    return result;
+}
+
+int db_pool_is_closed(db_pool_t *pool)
+{
+    int result;
+
+    if (!pool) {
+        err_last = err_input;
+        return -1;
+    }
+
+    if (pthread_rwlock_rdlock(&pool->rw_lock) != 0) {
+        err_last = err_rwlock;
+        return -1;
+    }
+
+    result = pool->is_closed;
+
+    pthread_rwlock_unlock(&pool->rw_lock);
+
+    return result;
+}
+
+MYSQL *db_pool_get_conn(db_pool_t *pool)
+{
+    return db_pool_get_conn_prio(pool, DB_PRIO_INTERACTIVE,
+            DB_WAIT_FOREVER);
+}
+
+MYSQL *db_pool_get_conn_timed(db_pool_t *pool, uint64_t timeout_ns)
+{
+    return db_pool_get_conn_prio(pool, DB_PRIO_INTERACTIVE, timeout_ns);
+}
+
+MYSQL *db_pool_try_get_conn(db_pool_t *pool)
+{
+    return db_pool_get_conn_prio(pool, DB_PRIO_INTERACTIVE, 0U);
+}
+
+MYSQL *db_pool_get_conn_prio(db_pool_t *pool, int priority,
+        uint64_t timeout_ns)
+{
+    struct db_slot *slot;
+
+    slot = db_pool_get_handle_prio(pool, priority, timeout_ns);
+    if (!slot) {
+        return NULL;
+    }
+
+    return atomic_load_explicit(&slot->mysql_conn, memory_order_relaxed);
+}
+
+int db_pool_post_conn(db_pool_t *pool, MYSQL *mysql_conn)
+{
+    struct db_slot *slot;
+
+    if (!is_inited) {
+        err_last = err_init;
+        return -1;
+    }
+
+    if (!pool || !mysql_conn) {
+        err_last = err_input;
+        return -1;
+    }
+
+    slot = pool_find_slot(pool, mysql_conn);
+    if (!slot) {
+        err_last = err_not_borrowed;
+        return -1;
+    }
+
+    return db_post_handle(slot);
+}
+
+db_handle_t *db_pool_get_handle(db_pool_t *pool)
+{
+    return db_pool_get_handle_prio(pool, DB_PRIO_INTERACTIVE,
+            DB_WAIT_FOREVER);
+}
+
+db_handle_t *db_pool_get_handle_timed(db_pool_t *pool, uint64_t timeout_ns)
+{
+    return db_pool_get_handle_prio(pool, DB_PRIO_INTERACTIVE, timeout_ns);
+}
+
+db_handle_t *db_pool_try_get_handle(db_pool_t *pool)
+{
+    return db_pool_get_handle_prio(pool, DB_PRIO_INTERACTIVE, 0U);
+}
+
+db_handle_t *db_pool_get_handle_prio(db_pool_t *pool, int priority,
+        uint64_t timeout_ns)
+{
+    if (!pool || priority < DB_PRIO_INTERACTIVE ||
+            priority > DB_PRIO_BACKGROUND) {
+        err_last = err_input;
+        return NULL;
+    }
+
+    return slot_acquire(pool, deadline_from(timeout_ns), priority, NULL);
+}
+
+MYSQL *db_pool_get_conn_for(db_pool_t *pool, int mode)
+{
+    struct db_slot *slot;
+
+    slot = db_pool_get_handle_for(pool, mode, DB_PRIO_INTERACTIVE,
+            DB_WAIT_FOREVER);
+    if (!slot) {
+        return NULL;
+    }
+
+    return atomic_load_explicit(&slot->mysql_conn, memory_order_relaxed);
+}
+
+db_handle_t *db_pool_get_handle_for(db_pool_t *pool, int mode,
+        int priority, uint64_t timeout_ns)
+{
+    unsigned int i;
+    unsigned int j;
+    unsigned int count;
+    unsigned int first;
+    int busy;
+    int any_busy;
+    uint64_t deadline_ns;
+    uint64_t scores[DB_POOL_REPLICAS_MAX];
+    struct db_pool *order[DB_POOL_REPLICAS_MAX];
+    struct db_slot *slot;
+
+    if (!pool || (mode != DB_READ && mode != DB_WRITE) ||
+            priority < DB_PRIO_INTERACTIVE ||
+            priority > DB_PRIO_BACKGROUND) {
+        err_last = err_input;
+        return NULL;
+    }
+
+    deadline_ns = deadline_from(timeout_ns);
+
+    if (mode == DB_WRITE) {
+        slot = slot_acquire(pool, deadline_ns, priority, NULL);
+        if (slot) {
+            slot->for_write = 1;
+        }
+
+        return slot;
+    }
+
+    count = atomic_load_explicit(&pool->replicas_count,
+            memory_order_acquire);
+
+    /*
+     * the reads which follow a write of the same thread too closely go
+     * to the primary, the replicas may not have the write yet
+     */
+    if (count > 0U && pool->cfg.rw_window_ms &&
+            thread_write_pool_id == pool->id &&
+            now_ns() - thread_write_ns <
+            (uint64_t)pool->cfg.rw_window_ms * UINT64_C(1000000)) {
+        count = 0U;
+    }
+
+    if (count > 0U) {
+        /*
+         * order the replicas by their load, the rotating start breaks
+         * the ties, so the idle replicas share the load
+         */
+        first = atomic_fetch_add_explicit(&pool->replica_next, 1U,
+                memory_order_relaxed);
+
+        for (i = 0U; i < count; i++) {
+            struct db_pool *replica = pool->replicas[(first + i) % count];
+            const uint64_t score = pool_score(replica);
+
+            for (j = i; j > 0U && scores[j - 1U] > score; j--) {
+                scores[j] = scores[j - 1U];
+                order[j] = order[j - 1U];
+            }
+
+            scores[j] = score;
+            order[j] = replica;
+        }
+
+        /*
+         * a free connection of the least loaded replica which has one,
+         * then wait on the least loaded one
+         */
+        any_busy = 0;
+        for (i = 0U; i < count; i++) {
+            slot = slot_acquire(order[i], DEADLINE_POLL, priority, &busy);
+            if (slot) {
+                return slot;
+            }
+
+            any_busy |= busy;
+        }
+
+        if (deadline_ns == DEADLINE_POLL) {
+            /*
+             * a busy replica is usable, it is only out of connections
+             * right now, so the read does not go to the primary
+             */
+            if (any_busy) {
+                err_last = err_busy;
+                return NULL;
+            }
+        } else {
+            slot = slot_acquire(order[0], deadline_ns, priority, NULL);
+            if (slot) {
+                return slot;
+            }
+
+            if (deadline_ns != DEADLINE_NONE && now_ns() >= deadline_ns) {
+                return NULL;
+            }
+        }
+
+        /* the replicas are closed or can not connect, use the primary */
+    }
+
+    return slot_acquire(pool, deadline_ns, priority, NULL);
+}
+
+int db_pool_add_replica(db_pool_t *pool, db_pool_t *replica)
+{
+    unsigned int count;
+
+    if (!is_inited) {
+        err_last = err_init;
+        return -1;
+    }
+
+    if (!pool || !replica || pool == replica) {
+        err_last = err_input;
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&db_mutex) != 0) {
+        err_last = err_mutex;
+        return -1;
+    }
+
+    count = atomic_load_explicit(&pool->replicas_count,
+            memory_order_relaxed);
+
+    /*
+     * only one level of replicas, a pool is a replica of one primary
+     */
+    if (count == DB_POOL_REPLICAS_MAX || replica->primary ||
+            pool->primary ||
+            atomic_load_explicit(&replica->replicas_count,
+                memory_order_relaxed) > 0U) {
+        pthread_mutex_unlock(&db_mutex);
+
+        err_last = err_input;
+        return -1;
+    }
+
+    replica->primary = pool;
+    atomic_store_explicit(&replica->measured, 1, memory_order_relaxed);
+    pool->replicas[count] = replica;
+    atomic_store_explicit(&pool->replicas_count, count + 1U,
+            memory_order_release);
+
+    pthread_mutex_unlock(&db_mutex);
+
+    return 0;
+}
+
+static struct db_slot *slot_acquire(struct db_pool *pool,
+        uint64_t deadline_ns, int priority, int *busy)
+{
+    struct db_slot *slot;
+
+    if (busy) {
+        *busy = 0;
+    }
+
+    if (!is_inited) {
+        err_last = err_init;
+        return NULL;
+    }
+
+    /*
+     * the increment and the `is_open` load are sequentially consistent
+     * and so are the store of `is_open` and the load of `acquirers` in
+     * `db_pool_close`, so either we see the pool closed or the closing
+     * thread waits for us
+     */
+    atomic_fetch_add(&pool->acquirers, 1U);
+
+    slot = slot_take(pool, deadline_ns, priority, busy);
+
+    if (atomic_fetch_sub(&pool->acquirers, 1U) == 1U &&
+            !atomic_load(&pool->is_open)) {
+        /* the pool is closing, this wakes the closing thread up */
+        slot_wake(pool);
+    }
+
+    if (!slot) {
+        return NULL;
+    }
+
+    return slot_ready(pool, slot);
+}
+
+static struct db_slot *slot_take(struct db_pool *pool,
+        uint64_t deadline_ns, int priority, int *busy)
+{
+    unsigned int shard;
+    struct db_slot *slot;
+
+    if (!atomic_load(&pool->is_open)) {
+        err_last = err_not_open;
+        return NULL;
+    }
+
+    if (pool->cfg.thread_cache) {
+        struct db_cached *cached = thread_cached(pool);
+
+        /*
+         * the connection returned last by this thread, unless somebody
+         * stole it
+         */
+        if (atomic_load_explicit(&cached->slot, memory_order_relaxed)) {
+            slot = atomic_exchange(&cached->slot, NULL);
+            if (slot && slot_uncache(slot)) {
+                goto found;
+            }
+        }
+    }
+
+    shard = shard_current(pool);
+
+    /*
+     * the waiting threads are served first, so nobody waits forever
+     * while the others keep getting the returned connections
+     */
+    slot = NULL;
+    if (!atomic_load(&pool->conns_waiters)) {
+        slot = slot_get(pool, shard, pool->cfg.grow_wait_ms == 0U, priority);
+    }
+
+    if (!slot) {
+        if (deadline_ns == DEADLINE_POLL) {
+            if (busy) {
+                *busy = 1;
+            }
+
+            err_last = err_busy;
+            return NULL;
+        }
+
+        slot = slot_wait(pool, shard, deadline_ns, priority);
+        if (!slot) {
+            return NULL;
+        }
+    }
+
+found:
+    /*
+     * checking another time because it's possible that the pool was
+     * closed while we were taking the slot
+     */
+    if (!atomic_load(&pool->is_open)) {
+        slot_release(slot);
+
+        err_last = err_not_open;
+        return NULL;
+    }
+
+    return slot;
+}
+
+static struct db_slot *slot_ready(struct db_pool *pool,
+        struct db_slot *slot)
+{
+    uint64_t now;
+
+    if (!atomic_load_explicit(&slot->mysql_conn, memory_order_relaxed)) {
+        /*
+         * we own the slot, so nobody else touches it while we are
+         * connecting
+         */
+        if (slot_connect(slot) != 0) {
+            slot_release(slot);
+
+            err_last = err_connect;
+            return NULL;
+        }
+    }
+
+    now = now_ns();
+
+    /*
+     * a new connection was used just now, so it is not checked
+     */
+    if (pool->cfg.validate_idle_ms &&
+            slot_idle_ns(slot, now) > (uint64_t)pool->cfg.validate_idle_ms *
+            UINT64_C(1000000)) {
+        if (slot_check(slot) != 0) {
+            slot_release(slot);
+
+            err_last = err_connect;
+            return NULL;
+        }
+
+        now = now_ns();
+    }
+
+    slot->generation++;
+    slot->acquired_ns = now;
+
+    slot->measured = atomic_load_explicit(&pool->measured,
+            memory_order_relaxed);
+    if (slot->measured) {
+        atomic_fetch_add_explicit(&pool->in_flight, 1U,
+                memory_order_relaxed);
+    }
+
+    return slot;
+}
+
+int db_post_handle(db_handle_t *handle)
+{
+    struct db_pool *pool;
+    uint64_t now;
+    int expected = SLOT_BUSY;
+
+    if (!is_inited) {
+        err_last = err_init;
+        return -1;
+    }
+
+    if (!handle) {
+        err_last = err_input;
+        return -1;
+    }
+
+    pool = handle->pool;
+
+    /*
+     * claiming the slot first protects it from a connection which is
+     * returned twice, only one of the returns gets past this, so the
+     * rest of the function can reconnect the slot safely
+     */
+    if (!atomic_compare_exchange_strong(&handle->state, &expected,
+                SLOT_RETURNING)) {
+        err_last = err_not_borrowed;
+        return -1;
+    }
+
+    if (handle->measured) {
+        uint64_t latency_ns;
+        const uint64_t held_ns = now_ns() - handle->acquired_ns;
+
+        /*
+         * the average moves by 1/8 of the difference, a concurrent
+         * update may overwrite this one, which only loses a sample
+         */
+        latency_ns = atomic_load_explicit(&pool->latency_ns,
+                memory_order_relaxed);
+        atomic_store_explicit(&pool->latency_ns,
+                latency_ns - latency_ns / 8U + held_ns / 8U,
+                memory_order_relaxed);
+        atomic_fetch_sub_explicit(&pool->in_flight, 1U,
+                memory_order_relaxed);
+        handle->measured = 0;
+    }
+
+    if (handle->for_write) {
+        handle->for_write = 0;
+
+        thread_write_ns = now_ns();
+        thread_write_pool_id = pool->id;
+    }
+
+    if (pool->cfg.idle_timeout_ms || pool->cfg.health_interval_ms ||
+            pool->cfg.validate_idle_ms) {
+        now = now_ns();
+
+        /*
+         * the slot is still ours, so the time is visible to whoever
+         * pops it next
+         */
+        handle->released_ns = now;
+
+        if (pool->cfg.idle_timeout_ms) {
+            slots_reap_due(pool, now);
+        }
+    }
+
+    /*
+     * everything allocated during the borrow is released at once, this
+     * comes after the slot was claimed, so a handle returned twice can
+     * not free the arena of the next borrower
+     */
+    slot_arena_reset(handle);
+
+    /*
+     * the protocol state of a connection with an unfinished operation
+     * is unknown, so it is not reused
+     */
+    if (handle->async_result) {
+        mysql_free_result(handle->async_result);
+        handle->async_result = NULL;
+    }
+    if (handle->async_op != ASYNC_NONE || handle->streaming) {
+        handle->async_op = ASYNC_NONE;
+        handle->streaming = 0;
+
+        /* a failure leaves the slot empty, it is connected on demand */
+        slot_renew(handle);
+    }
+
+    /*
+     * replace an old connection here, so the borrowers never wait for
+     * it, the slot was claimed above, so nobody else uses it
+     */
+    if (pool->cfg.max_lifetime_ms && now_ns() >= handle->retire_ns &&
+            atomic_load(&pool->is_open)) {
+        /* a failure leaves the slot empty, it is connected on demand */
+        slot_renew(handle);
+    }
+
+    /*
+     * the reserved connections always go back to the reserve and the
+     * empty slots to `conns_empty`
+     */
+    if (pool->cfg.thread_cache && !handle->reserved &&
+            atomic_load_explicit(&handle->mysql_conn, memory_order_relaxed)) {
+        struct db_cached *cached = thread_cached(pool);
+        struct db_slot *old = atomic_load(&cached->slot);
+
+        /*
+         * the entry is shared by the threads with the same number, the
+         * slot of another one stays, the slots are all in this pool, so
+         * a stale pointer is still safe to look at
+         */
+        if (!old || old == handle ||
+                atomic_load(&old->state) != SLOT_CACHED) {
+            /*
+             * keep the connection aside for this thread, the store is
+             * sequentially consistent like the loads below
+             */
+            atomic_store(&handle->state, SLOT_CACHED);
+            atomic_store(&cached->slot, handle);
+
+            /*
+             * unless somebody waits for a connection or the pool is
+             * being closed, these are checked after the state change,
+             * so either we see them or they see the cached connection
+             */
+            if (!atomic_load(&pool->conns_waiters) &&
+                    atomic_load(&pool->is_open)) {
+                return 0;
+            }
+
+            if (!slot_uncache(handle)) {
+                /* it was stolen already, that's fine */
+                return 0;
+            }
+        }
+    }
+
+    return slot_release(handle);
+}
+
+MYSQL *db_handle_conn(const db_handle_t *handle)
+{
+    return atomic_load_explicit(&handle->mysql_conn, memory_order_relaxed);
+}
+
+unsigned int db_handle_slot(const db_handle_t *handle)
+{
+    return handle->index;
+}
+
+uint64_t db_handle_generation(const db_handle_t *handle)
+{
+    return handle->generation;
+}
+
+uint64_t db_handle_acquired(const db_handle_t *handle)
+{
+    return handle->acquired_ns;
+}
+
+db_pool_t *db_handle_pool(const db_handle_t *handle)
+{
+    return handle->pool;
+}
+
+MYSQL_STMT *db_prepare_cached(MYSQL *mysql_conn, const char *sql)
+{
+    struct db_pool *pool;
+
+    if (!is_inited) {
+        err_last = err_init;
+        return NULL;
+    }
+
+    pool = atomic_load_explicit(&db_default, memory_order_acquire);
+    if (!pool) {
+        err_last = err_not_borrowed;
+        return NULL;
+    }
+
+    return db_pool_prepare_cached(pool, mysql_conn, sql);
+}
+
+MYSQL_STMT *db_pool_prepare_cached(db_pool_t *pool, MYSQL *mysql_conn,
+        const char *sql)
+{
+    struct db_slot *slot;
+
+    if (!is_inited) {
+        err_last = err_init;
+        return NULL;
+    }
+
+    if (!pool || !mysql_conn || !sql) {
+        err_last = err_input;
+        return NULL;
+    }
+
+    slot = pool_find_slot(pool, mysql_conn);
+    if (!slot) {
+        err_last = err_not_borrowed;
+        return NULL;
+    }
+
+    return db_handle_prepare(slot, sql, (unsigned long)strlen(sql));
+}
+
+MYSQL_STMT *db_handle_prepare(db_handle_t *handle, const char *sql,
+        unsigned long length)
+{
+    if (!is_inited) {
+        err_last = err_init;
+        return NULL;
+    }
+
+    if (!handle || !sql) {
+        err_last = err_input;
+        return NULL;
+    }
+
+    return slot_stmt(handle, sql, length, hash_fnv1a(sql, length));
+}
+
+int db_register_query(const char *sql)
+{
+    unsigned int i;
+    unsigned int count;
+    unsigned long length;
+    char *copy;
+
+    if (!sql) {
+        err_last = err_input;
+        return -1;
+    }
+
+    length = (unsigned long)strlen(sql);
+
+    if (pthread_mutex_lock(&db_queries_mutex) != 0) {
+        err_last = err_mutex;
+        return -1;
+    }
+
+    count = atomic_load_explicit(&db_queries_count, memory_order_relaxed);
+
+    for (i = 0U; i < count; i++) {
+        if (db_queries[i].length == length &&
+                memcmp(db_queries[i].sql, sql, length) == 0) {
+            pthread_mutex_unlock(&db_queries_mutex);
+            return (int)i;
+        }
+    }
+
+    if (count == DB_QUERIES_MAX) {
+        pthread_mutex_unlock(&db_queries_mutex);
+        err_last = err_queries_full;
+        return -1;
+    }
+
+    copy = strdup(sql);
+    if (!copy) {
+        pthread_mutex_unlock(&db_queries_mutex);
+        err_last = err_alloc;
+        return -1;
+    }
+
+    db_queries[count].sql = copy;
+    db_queries[count].length = length;
+    atomic_store_explicit(&db_queries_count, count + 1U,
+            memory_order_release);
+
+    pthread_mutex_unlock(&db_queries_mutex);
+
+    return (int)count;
+}
+
+MYSQL_STMT *db_handle_stmt(db_handle_t *handle, int id)
+{
+    if (!handle || id < 0 || (unsigned int)id >=
+            atomic_load_explicit(&db_queries_count, memory_order_acquire)) {
+        err_last = err_input;
+        return NULL;
+    }
+
+    return slot_query(handle, (unsigned int)id);
+}
+
+MYSQL_STMT *db_stmt(MYSQL *mysql_conn, int id)
+{
+    struct db_pool *pool;
+
+    if (!is_inited) {
+        err_last = err_init;
+        return NULL;
+    }
+
+    pool = atomic_load_explicit(&db_default, memory_order_acquire);
+    if (!pool) {
+        err_last = err_not_borrowed;
+        return NULL;
+    }
+
+    return db_pool_stmt(pool, mysql_conn, id);
+}
+
+MYSQL_STMT *db_pool_stmt(db_pool_t *pool, MYSQL *mysql_conn, int id)
+{
+    struct db_slot *slot;
+
+    if (!is_inited) {
+        err_last = err_init;
+        return NULL;
+    }
+
+    if (!pool || !mysql_conn) {
+        err_last = err_input;
+        return NULL;
+    }
+
+    slot = pool_find_slot(pool, mysql_conn);
+    if (!slot) {
+        err_last = err_not_borrowed;
+        return NULL;
+    }
+
+    return db_handle_stmt(slot, id);
+}
+
+long db_stmt_fetch_rows(MYSQL_STMT *stmt, MYSQL_BIND *bind, size_t row_size,
+        unsigned long max_rows)
+{
+    int ret;
+    unsigned int columns;
+    unsigned long rows = 0UL;
+    unsigned long moved = 0UL;
+    long result = 0L;
+
+    if (!stmt || !bind || max_rows == 0UL || max_rows > LONG_MAX ||
+            (max_rows > 1UL && (row_size == 0U ||
+                                row_size > PTRDIFF_MAX / max_rows))) {
+        err_last = err_input;
+        return -1;
+    }
+
+    columns = mysql_stmt_field_count(stmt);
+    if (columns == 0U) {
+        err_last = err_input;
+        return -1;
+    }
+
+    /*
+     * the client library copies the bind array, so it is bound again
+     * for every row with the pointers moved to the next row
+     */
+    for (;;) {
+        if (mysql_stmt_bind_result(stmt, bind)) {
+            err_last = err_fetch;
+            result = -1;
+            break;
+        }
+
+        ret = mysql_stmt_fetch(stmt);
+        if (ret == MYSQL_NO_DATA) {
+            break;
+        }
+
+        if (ret != 0 && ret != MYSQL_DATA_TRUNCATED) {
+            err_last = err_fetch;
+            result = -1;
+            break;
+        }
+
+        if (++rows == max_rows) {
+            break;
+        }
+
+        bind_move(bind, columns, (ptrdiff_t)row_size);
+        moved++;
+    }
+
+    if (moved > 0UL) {
+        bind_move(bind, columns, -(ptrdiff_t)(row_size * moved));
+
+        /*
+         * the statement keeps the moved pointers otherwise, which
+         * point past the rows if the caller fetches with it later
+         */
+        if (mysql_stmt_bind_result(stmt, bind) && result == 0L) {
+            err_last = err_fetch;
+            result = -1;
+        }
+    }
+
+    return result < 0 ? result : (long)rows;
+}
+
+int db_stream_query(MYSQL *mysql_conn, const char *query,
+        unsigned int batch_rows, db_rows_cb cb, void *arg)
+{
+    struct db_pool *pool;
+
+    if (!is_inited) {
+        err_last = err_init;
+        return -1;
+    }
+
+    pool = atomic_load_explicit(&db_default, memory_order_acquire);
+    if (!pool) {
+        err_last = err_not_borrowed;
+        return -1;
+    }
+
+    return db_pool_stream_query(pool, mysql_conn, query, batch_rows, cb,
+            arg);
+}
+
+int db_pool_stream_query(db_pool_t *pool, MYSQL *mysql_conn,
+        const char *query, unsigned int batch_rows, db_rows_cb cb,
+        void *arg)
+{
+    struct db_slot *slot;
+
+    if (!is_inited) {
+        err_last = err_init;
+        return -1;
+    }
+
+    if (!pool || !mysql_conn || !query) {
+        err_last = err_input;
+        return -1;
+    }
+
+    slot = pool_find_slot(pool, mysql_conn);
+    if (!slot) {
+        err_last = err_not_borrowed;
+        return -1;
+    }
+
+    return db_handle_stream(slot, query, (unsigned long)strlen(query),
+            batch_rows, cb, arg);
+}
+
+int db_handle_stream(db_handle_t *handle, const char *query,
+        unsigned long length, unsigned int batch_rows, db_rows_cb cb,
+        void *arg)
+{
+    MYSQL *mysql_conn;
+    MYSQL_RES *res;
+    MYSQL_ROW row;
+    unsigned long *row_lengths;
+    unsigned int fields;
+    unsigned int i;
+    unsigned long rows;
+    size_t count;
+    size_t k;
+    size_t need;
+    size_t data_size = 0U;
+    size_t data_used;
+    char **values = NULL;
+    unsigned long *lengths = NULL;
+    size_t *offsets = NULL;
+    char *data = NULL;
+    char *grown;
+    int end = 0;
+    int result = 0;
+
+    if (!handle || !query || batch_rows == 0U || !cb) {
+        err_last = err_input;
+        return -1;
+    }
+
+    if (handle->async_op != ASYNC_NONE || handle->streaming) {
+        err_last = err_async_busy;
+        return -1;
+    }
+
+    mysql_conn = atomic_load_explicit(&handle->mysql_conn,
+            memory_order_relaxed);
+
+    if (mysql_real_query(mysql_conn, query, length) != 0) {
+        err_last = err_query;
+        return -1;
+    }
+
+    res = mysql_use_result(mysql_conn);
+    if (!res) {
+        if (mysql_field_count(mysql_conn) != 0U) {
+            err_last = err_query;
+            return -1;
+        }
+
+        /* the statement has no result set */
+        return 0;
+    }
+
+    fields = mysql_num_fields(res);
+    count = (size_t)batch_rows * fields;
+
+    /*
+     * the values of a batch are copied to `data`, which grows to the
+     * size of the largest batch, their offsets are turned into pointers
+     * when the batch is complete, since `data` may move while it grows
+     */
+    values = malloc(count * sizeof(*values));
+    lengths = malloc(count * sizeof(*lengths));
+    offsets = malloc(count * sizeof(*offsets));
+    if (!values || !lengths || !offsets) {
+        err_last = err_alloc;
+        result = -1;
+        goto done;
+    }
+
+    while (!end) {
+        rows = 0UL;
+        data_used = 0U;
+
+        while (rows < batch_rows) {
+            row = mysql_fetch_row(res);
+            if (!row) {
+                if (mysql_errno(mysql_conn) != 0U) {
+                    err_last = err_query;
+                    result = -1;
+                    goto done;
+                }
+
+                end = 1;
+                break;
+            }
+
+            row_lengths = mysql_fetch_lengths(res);
+
+            for (i = 0U; i < fields; i++) {
+                k = (size_t)rows * fields + i;
+
+                if (!row[i]) {
+                    offsets[k] = SIZE_MAX;
+                    lengths[k] = 0UL;
+                    continue;
+                }
+
+                need = data_used + row_lengths[i] + 1U;
+                if (need > data_size) {
+                    size_t size = data_size ? data_size : 4096U;
+
+                    while (size < need) {
+                        size *= 2U;
+                    }
+
+                    grown = realloc(data, size);
+                    if (!grown) {
+                        err_last = err_alloc;
+                        result = -1;
+                        goto done;
+                    }
+
+                    data = grown;
+                    data_size = size;
+                }
+
+                memcpy(data + data_used, row[i], row_lengths[i]);
+                data[data_used + row_lengths[i]] = '\0';
+                offsets[k] = data_used;
+                lengths[k] = row_lengths[i];
+                data_used = need;
+            }
+
+            rows++;
+        }
+
+        if (rows == 0UL) {
+            break;
+        }
+
+        for (k = 0U; k < (size_t)rows * fields; k++) {
+            values[k] = offsets[k] == SIZE_MAX ? NULL : data + offsets[k];
+        }
+
+        if (cb(values, lengths, rows, fields, arg) != 0) {
+            result = 1;
+            break;
+        }
+    }
+
+done:
+    free(values);
+    free(lengths);
+    free(offsets);
+    free(data);
+
+    if (end) {
+        mysql_free_result(res);
+    } else {
+        slot_stream_abort(handle, res);
+    }
+
+    return result;
+}
+
+void *db_handle_alloc(db_handle_t *handle, size_t size)
+{
+    struct db_chunk *chunk;
+    const size_t align = sizeof(max_align_t);
+
+    if (!handle || size > SIZE_MAX - align) {
+        err_last = err_input;
+        return NULL;
+    }
+
+    size = (size + align - 1U) & ~(align - 1U);
+
+    if (!handle->arena && handle->pool->cfg.arena_size) {
+        handle->arena = chunk_new(handle->pool->cfg.arena_size);
+        if (!handle->arena) {
+            err_last = err_alloc;
+            return NULL;
+        }
+    }
+
+    chunk = handle->arena_extra ? handle->arena_extra : handle->arena;
+
+    if (!chunk || chunk->size - chunk->used < size) {
+        chunk = chunk_new(size > handle->pool->cfg.arena_size ? size :
+                handle->pool->cfg.arena_size);
+        if (!chunk) {
+            err_last = err_alloc;
+            return NULL;
+        }
+
+        chunk->next = handle->arena_extra;
+        handle->arena_extra = chunk;
+    }
+
+    chunk->used += size;
+
+    return (char *)chunk->data + chunk->used - size;
+}
+
+char *db_handle_escape(db_handle_t *handle, const char *from,
+        unsigned long length, unsigned long *escaped_length)
+{
+    char *to;
+    unsigned long escaped;
+
+    if (!handle || !from || length > (ULONG_MAX - 1UL) / 2UL) {
+        err_last = err_input;
+        return NULL;
+    }
+
+    /* every character may be escaped */
+    to = db_handle_alloc(handle, (size_t)length * 2U + 1U);
+    if (!to) {
+        return NULL;
+    }
+
+    escaped = mysql_real_escape_string(atomic_load_explicit(
+                &handle->mysql_conn, memory_order_relaxed), to, from,
+            length);
+    if (escaped == (unsigned long)-1) {
+        err_last = err_input;
+        return NULL;
+    }
+
+    if (escaped_length) {
+        *escaped_length = escaped;
+    }
+
+    return to;
+}
+
+char *db_handle_printf(db_handle_t *handle, const char *format, ...)
+{
+    va_list args;
+    int length;
+    char *str;
+
+    if (!handle || !format) {
+        err_last = err_input;
+        return NULL;
+    }
+
+    va_start(args, format);
+    length = vsnprintf(NULL, 0U, format, args);
+    va_end(args);
+
+    if (length < 0) {
+        err_last = err_input;
+        return NULL;
+    }
+
+    str = db_handle_alloc(handle, (size_t)length + 1U);
+    if (!str) {
+        return NULL;
+    }
+
+    va_start(args, format);
+    vsnprintf(str, (size_t)length + 1U, format, args);
+    va_end(args);
+
+    return str;
+}
+
+MYSQL_ROW db_handle_copy_row(db_handle_t *handle, MYSQL_ROW row,
+        const unsigned long *lengths, unsigned int fields)
+{
+    unsigned int i;
+    size_t size;
+    MYSQL_ROW copy;
+    char *data;
+
+    if (!handle || !row || !lengths) {
+        err_last = err_input;
+        return NULL;
+    }
+
+    /* one block for the pointers and the values */
+    size = (size_t)fields * sizeof(*copy);
+    for (i = 0U; i < fields; i++) {
+        if (row[i]) {
+            size += lengths[i] + 1U;
+        }
+    }
+
+    copy = db_handle_alloc(handle, size);
+    if (!copy) {
+        return NULL;
+    }
+
+    data = (char *)(copy + fields);
+
+    for (i = 0U; i < fields; i++) {
+        if (!row[i]) {
+            copy[i] = NULL;
+            continue;
+        }
+
+        memcpy(data, row[i], lengths[i]);
+        data[lengths[i]] = '\0';
+        copy[i] = data;
+        data += lengths[i] + 1U;
+    }
+
+    return copy;
+}
+
+int db_ping(MYSQL *mysql_conn)
+{
+    if (!is_inited) {
+        err_last = err_init;
+        return -1;
+    }
+
+    if (!mysql_conn) {
+        err_last = err_input;
+        return -1;
+    }
+
+    if (mysql_ping(mysql_conn) != 0) {
+        err_last = err_ping;
+        return -1;
+    }
+
+    return 0;
+}
+
+#if defined(MYSQL_WAIT_READ)
+
+int db_async_query(db_handle_t *handle, const char *query,
+        unsigned long length)
+{
+    MYSQL *mysql_conn;
+
+    if (async_check(handle) != 0) {
+        return -1;
+    }
+
+    if (!query) {
+        err_last = err_input;
+        return -1;
+    }
+
+    mysql_conn = atomic_load_explicit(&handle->mysql_conn,
+            memory_order_relaxed);
+
+    if (handle->async_result) {
+        mysql_free_result(handle->async_result);
+        handle->async_result = NULL;
+    }
+
+    handle->async_op = ASYNC_QUERY;
+
+    return async_next(handle, mysql_real_query_start(&handle->async_error,
+                mysql_conn, query, length));
+}
+
+int db_async_ping(db_handle_t *handle)
+{
+    if (async_check(handle) != 0) {
+        return -1;
+    }
+
+    handle->async_op = ASYNC_PING;
+
+    return async_next(handle, mysql_ping_start(&handle->async_error,
+                atomic_load_explicit(&handle->mysql_conn,
+                    memory_order_relaxed)));
+}
+
+int db_async_cont(db_handle_t *handle, int events)
+{
+    MYSQL *mysql_conn;
+    int status;
+
+    if (!handle || handle->async_op == ASYNC_NONE) {
+        err_last = err_input;
+        return -1;
+    }
+
+    mysql_conn = atomic_load_explicit(&handle->mysql_conn,
+            memory_order_relaxed);
+
+    switch (handle->async_op) {
+    case ASYNC_QUERY:
+        status = mysql_real_query_cont(&handle->async_error, mysql_conn,
+                events);
+        break;
+    case ASYNC_STORE:
+        status = mysql_store_result_cont(&handle->async_result, mysql_conn,
+                events);
+        break;
+    default:
+        status = mysql_ping_cont(&handle->async_error, mysql_conn, events);
+        break;
+    }
+
+    return async_next(handle, status);
+}
+
+int db_async_fd(const db_handle_t *handle)
+{
+    if (!handle) {
+        err_last = err_input;
+        return -1;
+    }
+
+    return mysql_get_socket(atomic_load_explicit(&handle->mysql_conn,
+                memory_order_relaxed));
+}
+
+unsigned int db_async_timeout_ms(const db_handle_t *handle)
+{
+    return mysql_get_timeout_value_ms(atomic_load_explicit(
+                &handle->mysql_conn, memory_order_relaxed));
+}
+
+MYSQL_RES *db_async_result(db_handle_t *handle)
+{
+    MYSQL_RES *result;
+
+    if (!handle || handle->async_op != ASYNC_NONE) {
+        err_last = err_input;
+        return NULL;
+    }
+
+    result = handle->async_result;
+    handle->async_result = NULL;
+
+    return result;
+}
+
+static int async_check(const struct db_slot *slot)
+{
+    if (!is_inited) {
+        err_last = err_init;
+        return -1;
+    }
+
+    if (!slot) {
+        err_last = err_input;
+        return -1;
+    }
+
+    if (!slot->pool->cfg.nonblock) {
+        err_last = err_nonblock;
+        return -1;
+    }
+
+    if (slot->async_op != ASYNC_NONE) {
+        err_last = err_async_busy;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int async_next(struct db_slot *slot, int status)
+{
+    MYSQL *mysql_conn;
+
+    if (status) {
+        /* still waiting */
+        return status;
+    }
+
+    mysql_conn = atomic_load_explicit(&slot->mysql_conn,
+            memory_order_relaxed);
+
+    switch (slot->async_op) {
+    case ASYNC_QUERY:
+        if (slot->async_error) {
+            slot->async_op = ASYNC_NONE;
+            err_last = err_query;
+            return -1;
+        }
+
+        /* a statement without a result set is complete */
+        if (mysql_field_count(mysql_conn) == 0U) {
+            slot->async_op = ASYNC_NONE;
+            return 0;
+        }
+
+        slot->async_op = ASYNC_STORE;
+
+        status = mysql_store_result_start(&slot->async_result, mysql_conn);
+        if (status) {
+            return status;
+        }
+
+        /* fall through */
+    case ASYNC_STORE:
+        slot->async_op = ASYNC_NONE;
+
+        if (!slot->async_result) {
+            err_last = err_query;
+            return -1;
+        }
+
+        return 0;
+    default:
+        slot->async_op = ASYNC_NONE;
+
+        if (slot->async_error) {
+            err_last = err_ping;
+            return -1;
+        }
+
+        return 0;
+    }
+}
+
+#endif /* MYSQL_WAIT_READ */
+
+#if defined(DB_REACTOR)
+
+db_reactor_t *db_reactor_create(void)
+{
+    struct db_reactor *reactor;
+    struct epoll_event event;
+
+    reactor = calloc(1U, sizeof(*reactor));
+    if (!reactor) {
+        err_last = err_alloc;
+        return NULL;
+    }
+
+    reactor->event_fd = -1;
+    reactor->timer_fd = -1;
+    reactor->timer_ns = DEADLINE_NONE;
+
+    if (pthread_mutex_init(&reactor->ready_mutex, NULL) != 0) {
+        free(reactor);
+        err_last = err_init_mutex;
+        return NULL;
+    }
+
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->event_fd = eventfd(0U, EFD_NONBLOCK | EFD_CLOEXEC);
+    reactor->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+            TFD_NONBLOCK | TFD_CLOEXEC);
+    if (reactor->epoll_fd < 0 || reactor->event_fd < 0 ||
+            reactor->timer_fd < 0) {
+        reactor_free(reactor);
+        err_last = err_epoll;
+        return NULL;
+    }
+
+    /*
+     * the operations point to themselves in the events, these two
+     * point to the descriptor fields, which can't be mistaken for them
+     */
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = &reactor->event_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->event_fd,
+                &event) != 0) {
+        reactor_free(reactor);
+        err_last = err_epoll;
+        return NULL;
+    }
+
+    event.data.ptr = &reactor->timer_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->timer_fd,
+                &event) != 0) {
+        reactor_free(reactor);
+        err_last = err_epoll;
+        return NULL;
+    }
+
+    return reactor;
+}
+
+int db_reactor_destroy(db_reactor_t *reactor)
+{
+    if (!reactor) {
+        err_last = err_input;
+        return -1;
+    }
+
+    if (reactor->pending) {
+        err_last = err_pending;
+        return -1;
+    }
+
+    reactor_free(reactor);
+
+    return 0;
+}
+
+int db_reactor_fd(const db_reactor_t *reactor)
+{
+    return reactor->epoll_fd;
+}
+
+unsigned int db_reactor_pending(const db_reactor_t *reactor)
+{
+    return reactor->pending;
+}
+
+int db_reactor_run(db_reactor_t *reactor, int timeout_ms)
+{
+    struct epoll_event events[DB_REACTOR_EVENTS];
+    int count;
+    int called;
+    int i;
+
+    if (!reactor) {
+        err_last = err_input;
+        return -1;
+    }
+
+    if (reactor_arm(reactor) != 0) {
+        return -1;
+    }
+
+    count = epoll_wait(reactor->epoll_fd, events, DB_REACTOR_EVENTS,
+            timeout_ms);
+    if (count < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+
+        err_last = err_epoll;
+        return -1;
+    }
+
+    called = 0;
+    for (i = 0; i < count; i++) {
+        void *ptr = events[i].data.ptr;
+        struct db_op *op = ptr;
+        int async_events = 0;
+
+        /*
+         * the ready operations and the deadlines are checked below
+         * anyway
+         */
+        if (ptr == &reactor->event_fd || ptr == &reactor->timer_fd) {
+            fd_drain(*(int *)ptr);
+            continue;
+        }
+
+        /*
+         * an error or a hang-up is passed on as the awaited event, the
+         * next read or write reports it
+         */
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+            async_events |= DB_ASYNC_READ;
+        }
+        if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+            async_events |= DB_ASYNC_WRITE;
+        }
+        if (events[i].events & EPOLLPRI) {
+            async_events |= DB_ASYNC_EXCEPT;
+        }
+
+        called += op_async(op, db_async_cont(op->handle,
+                    async_events & op->status));
+    }
+
+    called += reactor_ready(reactor);
+    called += reactor_expire(reactor);
+
+    return called;
+}
+
+int db_reactor_acquire(db_reactor_t *reactor, db_pool_t *pool,
+        int priority, uint64_t timeout_ns, db_acquire_cb callback,
+        void *arg)
+{
+    struct db_op *op;
+    struct db_slot *slot;
+    int busy;
+
+    if (!reactor || !pool || !callback ||
+            priority < DB_PRIO_INTERACTIVE ||
+            priority > DB_PRIO_BACKGROUND) {
+        err_last = err_input;
+        return -1;
+    }
+
+    op = op_new(reactor, OP_ACQUIRE, arg);
+    if (!op) {
+        return -1;
+    }
+
+    op->pool = pool;
+    op->acquire_cb = callback;
+
+    slot = slot_acquire(pool, DEADLINE_POLL, priority, &busy);
+    if (slot) {
+        /* the callback is called from `db_reactor_run` */
+        op->waiter.slot = slot;
+        op_ready(op);
+        return 0;
+    }
+
+    if (!busy) {
+        op_free(op);
+        return -1;
+    }
+
+    if (timeout_ns == 0U) {
+        /*
+         * not waiting, so it fails like a timeout would, through the
+         * callback, `waiter.slot` is NULL
+         */
+        op_ready(op);
+        return 0;
+    }
+
+    op->deadline_ns = deadline_from(timeout_ns);
+
+    op->waiter.op = op;
+    op->waiter.slot = NULL;
+    op->waiter.shard = shard_current(pool);
+    op->waiter.priority = priority;
+
+    /* the same growing rules as for the waiting threads */
+    op->waiter.grow = pool->cfg.grow_wait_ms == 0U;
+    if (!op->waiter.grow) {
+        op->grow_ns = now_ns() +
+            (uint64_t)pool->cfg.grow_wait_ms * UINT64_C(1000000);
+    }
+
+    if (pthread_mutex_lock(&pool->wait_mutex) != 0) {
+        op_free(op);
+        err_last = err_mutex;
+        return -1;
+    }
+
+    waiter_enqueue(pool, &op->waiter);
+    atomic_fetch_add(&pool->conns_waiters, 1U);
+    op->queued = 1;
+
+    pthread_mutex_unlock(&pool->wait_mutex);
+
+    /*
+     * a connection may have been returned before we were counted, this
+     * hands it over to whoever is the first in the queue
+     */
+    slot_wake(pool);
+
+    return 0;
+}
+
+int db_reactor_query(db_reactor_t *reactor, db_handle_t *handle,
+        const char *query, unsigned long length, db_done_cb callback,
+        void *arg)
+{
+    struct db_op *op;
+
+    if (!reactor || !callback || !query) {
+        err_last = err_input;
+        return -1;
+    }
+
+    /* after this a failure is a failure of the query itself */
+    if (async_check(handle) != 0) {
+        return -1;
+    }
+
+    op = op_new(reactor, OP_ASYNC, arg);
+    if (!op) {
+        return -1;
+    }
+
+    op->handle = handle;
+    op->done_cb = callback;
+
+    if (op_async_start(op, db_async_query(handle, query, length)) != 0) {
+        op_free(op);
+        return -1;
+    }
+
+    return 0;
+}
+
+int db_reactor_ping(db_reactor_t *reactor, db_handle_t *handle,
+        db_done_cb callback, void *arg)
+{
+    struct db_op *op;
+
+    if (!reactor || !callback) {
+        err_last = err_input;
+        return -1;
+    }
+
+    if (async_check(handle) != 0) {
+        return -1;
+    }
+
+    op = op_new(reactor, OP_ASYNC, arg);
+    if (!op) {
+        return -1;
+    }
+
+    op->handle = handle;
+    op->done_cb = callback;
+
+    if (op_async_start(op, db_async_ping(handle)) != 0) {
+        op_free(op);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void reactor_free(struct db_reactor *reactor)
+{
+    if (reactor->timer_fd >= 0) {
+        close(reactor->timer_fd);
+    }
+    if (reactor->event_fd >= 0) {
+        close(reactor->event_fd);
+    }
+    if (reactor->epoll_fd >= 0) {
+        close(reactor->epoll_fd);
+    }
+
+    pthread_mutex_destroy(&reactor->ready_mutex);
+
+    free(reactor);
+}
+
+static int reactor_arm(struct db_reactor *reactor)
+{
+    struct db_op *op;
+    struct itimerspec spec;
+    uint64_t deadline_ns = DEADLINE_NONE;
+
+    for (op = reactor->ops; op; op = op->next) {
+        if (op->deadline_ns < deadline_ns) {
+            deadline_ns = op->deadline_ns;
+        }
+
+        if (op->kind == OP_ACQUIRE && op->queued && !op->waiter.grow &&
+                op->grow_ns < deadline_ns) {
+            deadline_ns = op->grow_ns;
+        }
+    }
+
+    if (deadline_ns == reactor->timer_ns) {
+        return 0;
+    }
+
+    /* a zero time disarms the timer, so a past one is used instead */
+    memset(&spec, 0, sizeof(spec));
+    if (deadline_ns != DEADLINE_NONE) {
+        spec.it_value = ns_to_timespec(deadline_ns ? deadline_ns : 1U);
+    }
+
+    if (timerfd_settime(reactor->timer_fd, TFD_TIMER_ABSTIME, &spec,
+                NULL) != 0) {
+        err_last = err_epoll;
+        return -1;
+    }
+
+    reactor->timer_ns = deadline_ns;
+
+    return 0;
+}
+
+static int reactor_ready(struct db_reactor *reactor)
+{
+    struct db_op *op;
+    int called = 0;
+
+    /*
+     * one at a time, the callbacks and the other threads may add more
+     * operations to the list meanwhile
+     */
+    for (;;) {
+        pthread_mutex_lock(&reactor->ready_mutex);
+
+        op = reactor->ready_head;
+        if (op) {
+            reactor->ready_head = op->ready_next;
+            if (!reactor->ready_head) {
+                reactor->ready_tail = NULL;
+            }
+            op->ready = 0;
+        }
+
+        pthread_mutex_unlock(&reactor->ready_mutex);
+
+        if (!op) {
+            break;
+        }
+
+        called += op->kind == OP_ACQUIRE ? op_acquire(op) :
+            op_async(op, op->status);
+    }
+
+    return called;
+}
+
+static int reactor_expire(struct db_reactor *reactor)
+{
+    struct db_op *op;
+    struct db_op *next;
+    struct db_pool *pool;
+    db_acquire_cb callback;
+    void *arg;
+    int called = 0;
+    const uint64_t now = now_ns();
+
+    /*
+     * the callbacks may add new operations to the head of the list,
+     * but they can't remove the others
+     */
+    for (op = reactor->ops; op; op = next) {
+        next = op->next;
+
+        if (op->kind == OP_ASYNC) {
+            if (now >= op->deadline_ns) {
+                called += op_async(op, db_async_cont(op->handle,
+                            DB_ASYNC_TIMEOUT));
+            }
+            continue;
+        }
+
+        if (!op->queued) {
+            continue;
+        }
+
+        pool = op->pool;
+
+        if (!op->waiter.grow && now >= op->grow_ns) {
+            if (pthread_mutex_lock(&pool->wait_mutex) != 0) {
+                continue;
+            }
+            op->waiter.grow = 1;
+            pthread_mutex_unlock(&pool->wait_mutex);
+
+            /* one more look into the stacks, growing this time */
+            slot_wake(pool);
+        }
+
+        if (now < op->deadline_ns ||
+                pthread_mutex_lock(&pool->wait_mutex) != 0) {
+            continue;
+        }
+
+        if (op->waiter.slot) {
+            /* handed over just in time, it is in the `ready` list */
+            pthread_mutex_unlock(&pool->wait_mutex);
+            continue;
+        }
+
+        waiter_dequeue(pool, &op->waiter);
+        op_leave(op);
+
+        pthread_mutex_unlock(&pool->wait_mutex);
+
+        callback = op->acquire_cb;
+        arg = op->arg;
+        op_free(op);
+
+        err_last = err_timeout;
+        callback(NULL, arg);
+        called++;
+    }
+
+    return called;
+}
+
+static struct db_op *op_new(struct db_reactor *reactor, int kind,
+        void *arg)
+{
+    struct db_op *op;
+
+    op = calloc(1U, sizeof(*op));
+    if (!op) {
+        err_last = err_alloc;
+        return NULL;
+    }
+
+    op->reactor = reactor;
+    op->kind = kind;
+    op->fd = -1;
+    op->deadline_ns = DEADLINE_NONE;
+    op->grow_ns = DEADLINE_NONE;
+    op->arg = arg;
+
+    op->next = reactor->ops;
+    if (op->next) {
+        op->next->prev = op;
+    }
+    reactor->ops = op;
+    reactor->pending++;
+
+    return op;
+}
+
+static void op_free(struct db_op *op)
+{
+    struct db_reactor *reactor = op->reactor;
+
+    if (op->prev) {
+        op->prev->next = op->next;
+    } else {
+        reactor->ops = op->next;
+    }
+
+    if (op->next) {
+        op->next->prev = op->prev;
+    }
+
+    reactor->pending--;
+
+    free(op);
+}
+
+static void op_ready(struct db_op *op)
+{
+    struct db_reactor *reactor = op->reactor;
+    const uint64_t one = 1U;
+
+    pthread_mutex_lock(&reactor->ready_mutex);
+
+    if (!op->ready) {
+        op->ready = 1;
+        op->ready_next = NULL;
+
+        if (reactor->ready_tail) {
+            reactor->ready_tail->ready_next = op;
+        } else {
+            reactor->ready_head = op;
+        }
+        reactor->ready_tail = op;
+    }
+
+    pthread_mutex_unlock(&reactor->ready_mutex);
+
+    /* it can fail only if the counter is about to overflow */
+    if (write(reactor->event_fd, &one, sizeof(one)) < 0) {
+        return;
+    }
+}
+
+static void op_leave(struct db_op *op)
+{
+    struct db_reactor *reactor = op->reactor;
+    struct db_pool *pool = op->pool;
+    struct db_op *prev;
+    struct db_op *cur;
+
+    /*
+     * it may have been woken up again in the meantime, it must not be
+     * in the `ready` list when it is freed
+     */
+    pthread_mutex_lock(&reactor->ready_mutex);
+
+    if (op->ready) {
+        prev = NULL;
+        for (cur = reactor->ready_head; cur != op; cur = cur->ready_next) {
+            prev = cur;
+        }
+
+        if (prev) {
+            prev->ready_next = op->ready_next;
+        } else {
+            reactor->ready_head = op->ready_next;
+        }
+
+        if (reactor->ready_tail == op) {
+            reactor->ready_tail = prev;
+        }
+
+        op->ready = 0;
+    }
+
+    pthread_mutex_unlock(&reactor->ready_mutex);
+
+    /* the next waiter may be the first one now */
+    if (pool->wait_head) {
+        waiter_notify(pool->wait_head);
+    }
+
+    atomic_fetch_sub(&pool->conns_waiters, 1U);
+    op->queued = 0;
+}
+
+static int op_acquire(struct db_op *op)
+{
+    struct db_pool *pool = op->pool;
+    struct db_slot *slot;
+    db_acquire_cb callback;
+    void *arg;
+
+    if (op->queued) {
+        if (pthread_mutex_lock(&pool->wait_mutex) != 0) {
+            /* try again when it is woken up the next time */
+            return 0;
+        }
+
+        slot = op->waiter.slot;
+        if (!slot) {
+            if (atomic_load(&pool->is_open)) {
+                /*
+                 * only the first waiter takes the free slots from the
+                 * stacks, the others wait for their turn
+                 */
+                if (pool->wait_head != &op->waiter) {
+                    pthread_mutex_unlock(&pool->wait_mutex);
+                    return 0;
+                }
+
+                slot = slot_get(pool, op->waiter.shard, op->waiter.grow,
+                        op->waiter.priority);
+                if (!slot) {
+                    pthread_mutex_unlock(&pool->wait_mutex);
+                    return 0;
+                }
+            }
+
+            waiter_dequeue(pool, &op->waiter);
+        }
+
+        op_leave(op);
+
+        pthread_mutex_unlock(&pool->wait_mutex);
+
+        if (slot) {
+            slot = slot_ready(pool, slot);
+        } else {
+            err_last = err_not_open;
+        }
+    } else {
+        slot = op->waiter.slot;
+        if (!slot) {
+            /* it was not allowed to wait */
+            err_last = err_busy;
+        }
+    }
+
+    callback = op->acquire_cb;
+    arg = op->arg;
+    op_free(op);
+
+    callback(slot, arg);
+
+    return 1;
+}
+
+static int op_async(struct db_op *op, int status)
+{
+    db_done_cb callback;
+    db_handle_t *handle;
+    void *arg;
+
+    if (status > 0 && op_async_start(op, status) == 0) {
+        return 0;
+    }
+
+    /*
+     * it is complete or the socket can't be watched, which fails it,
+     * the handle gets a new connection when it is returned then
+     */
+    if (status > 0) {
+        status = -1;
+    }
+
+    if (op->fd >= 0) {
+        epoll_ctl(op->reactor->epoll_fd, EPOLL_CTL_DEL, op->fd, NULL);
+    }
+
+    callback = op->done_cb;
+    handle = op->handle;
+    arg = op->arg;
+    op_free(op);
+
+    callback(handle, status < 0 ? -1 : 0, arg);
+
+    return 1;
+}
+
+static int op_async_start(struct db_op *op, int status)
+{
+    struct db_reactor *reactor = op->reactor;
+    struct epoll_event event;
+    int fd;
+
+    op->status = status;
+
+    if (status <= 0) {
+        /* the callback is called from `db_reactor_run` */
+        op_ready(op);
+        return 0;
+    }
+
+    /*
+     * the socket may change if the connection has reconnected by
+     * itself
+     */
+    fd = db_async_fd(op->handle);
+    if (op->fd >= 0 && op->fd != fd) {
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, op->fd, NULL);
+        op->fd = -1;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.data.ptr = op;
+
+    /*
+     * a wait for the timeout only still needs the socket in the set,
+     * epoll reports the errors and the hangups whatever the mask is,
+     * and the reads can't come before the server answers anyway
+     */
+    if (status & DB_ASYNC_READ ||
+            !(status & (DB_ASYNC_WRITE | DB_ASYNC_EXCEPT))) {
+        event.events |= EPOLLIN;
+    }
+    if (status & DB_ASYNC_WRITE) {
+        event.events |= EPOLLOUT;
+    }
+    if (status & DB_ASYNC_EXCEPT) {
+        event.events |= EPOLLPRI;
+    }
+
+    if (epoll_ctl(reactor->epoll_fd, op->fd >= 0 ? EPOLL_CTL_MOD :
+                EPOLL_CTL_ADD, fd, &event) != 0) {
+        err_last = err_epoll;
+        return -1;
+    }
+
+    op->fd = fd;
+
+    op->deadline_ns = DEADLINE_NONE;
+    if (status & DB_ASYNC_TIMEOUT) {
+        op->deadline_ns = now_ns() +
+            (uint64_t)db_async_timeout_ms(op->handle) * UINT64_C(1000000);
+    }
+
+    return 0;
+}
+
+static void fd_drain(int fd)
+{
+    uint64_t value;
+
+    /* a failure means the counter is zero already */
+    if (read(fd, &value, sizeof(value)) < 0) {
+        return;
+    }
+}
+
+#endif /* DB_REACTOR */
+
+static int lib_init(void)
+{
+    if (is_inited) {
+        return 0;
+    }
+
+    if (!mysql_thread_safe()) {
+        is_thread_safe = 0;
+        return -1;
+    }
+
+    is_thread_safe = 1;
+
+    if (mysql_library_init(0, NULL, NULL) != 0) {
+        err_last = err_init_lib;
+        return -1;
+    }
+
+    if (pthread_mutex_init(&db_mutex, NULL) != 0) {
+        err_last = err_init_mutex;
+        return -1;
+    }
+
+    is_inited = 1;
+
+    return 0;
+}
+
+static struct db_pool *pool_create(const char *name,
+        const struct db_config *config)
+{
+    size_t i;
+    struct db_pool *pool;
+
+    if (!config || config->max_conns == 0U ||
+            config->max_conns >= UINT32_MAX ||
+            config->min_conns > config->max_conns ||
+            config->reserved_conns >= config->max_conns ||
+            (config->warmup != DB_WARMUP_EAGER &&
+             config->warmup != DB_WARMUP_LAZY &&
+             config->warmup != DB_WARMUP_BACKGROUND)) {
+        err_last = err_input;
+        return NULL;
+    }
+
+#if !defined(MYSQL_WAIT_READ)
+    if (config->nonblock) {
+        err_last = err_nonblock;
+        return NULL;
+    }
+#endif
+
+    if (posix_memalign((void **)&pool, DB_CACHE_LINE,
+                sizeof(*pool)) != 0) {
+        err_last = err_alloc;
+        return NULL;
+    }
+
+    memset(pool, 0, sizeof(*pool));
+
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+        free(pool);
+        err_last = err_init_mutex;
+        return NULL;
+    }
+
+    if (pthread_rwlock_init(&pool->rw_lock, NULL) != 0) {
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+        err_last = err_init_rwlock;
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&pool->warm_mutex, NULL) != 0) {
+        pthread_rwlock_destroy(&pool->rw_lock);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+        err_last = err_init_mutex;
+        return NULL;
+    }
+
+    if (cond_init_monotonic(&pool->warm_cond) != 0) {
+        pthread_mutex_destroy(&pool->warm_mutex);
+        pthread_rwlock_destroy(&pool->rw_lock);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+        err_last = err_init_cond;
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&pool->maint_mutex, NULL) != 0) {
+        pthread_cond_destroy(&pool->warm_cond);
+        pthread_mutex_destroy(&pool->warm_mutex);
+        pthread_rwlock_destroy(&pool->rw_lock);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+        err_last = err_init_mutex;
+        return NULL;
+    }
+
+    if (cond_init_monotonic(&pool->maint_cond) != 0) {
+        pthread_mutex_destroy(&pool->maint_mutex);
+        pthread_cond_destroy(&pool->warm_cond);
+        pthread_mutex_destroy(&pool->warm_mutex);
+        pthread_rwlock_destroy(&pool->rw_lock);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+        err_last = err_init_cond;
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&pool->wait_mutex, NULL) != 0) {
+        pthread_cond_destroy(&pool->maint_cond);
+        pthread_mutex_destroy(&pool->maint_mutex);
+        pthread_cond_destroy(&pool->warm_cond);
+        pthread_mutex_destroy(&pool->warm_mutex);
+        pthread_rwlock_destroy(&pool->rw_lock);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+        err_last = err_init_mutex;
+        return NULL;
+    }
+
+    if (pthread_cond_init(&pool->wait_drain, NULL) != 0) {
+        pthread_mutex_destroy(&pool->wait_mutex);
+        pthread_cond_destroy(&pool->maint_cond);
+        pthread_mutex_destroy(&pool->maint_mutex);
+        pthread_cond_destroy(&pool->warm_cond);
+        pthread_mutex_destroy(&pool->warm_mutex);
+        pthread_rwlock_destroy(&pool->rw_lock);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+        err_last = err_init_cond;
+        return NULL;
+    }
+
+    atomic_init(&pool->is_open, 0);
+    pool->is_closed = 1;
+    pool->is_drained = 1;
+    atomic_init(&pool->conns_empty.head, 0U);
+    atomic_init(&pool->conns_reserved.head, 0U);
+    atomic_init(&pool->conns_waiters, 0U);
+    atomic_init(&pool->acquirers, 0U);
+    atomic_init(&pool->conns_connected, 0U);
+    atomic_init(&pool->reap_next_ns, 0U);
+    atomic_flag_clear(&pool->reap_running);
+    atomic_init(&pool->replicas_count, 0U);
+    atomic_init(&pool->replica_next, 0U);
+    atomic_init(&pool->measured, 0);
+    atomic_init(&pool->in_flight, 0U);
+    atomic_init(&pool->latency_ns, 0U);
+
+    /*
+     * from here on `pool_free` cleans up after a failure
+     */
+    if ((name && !(pool->name = strdup(name))) ||
+            config_copy(&pool->cfg, config) != 0) {
+        pool_free(pool);
+        err_last = err_alloc;
+        return NULL;
+    }
+
+    if (pool->cfg.thread_cache) {
+        if (posix_memalign((void **)&pool->cached, DB_CACHE_LINE,
+                    pool->cfg.max_conns * sizeof(*pool->cached)) != 0) {
+            pool->cached = NULL;
+            pool_free(pool);
+            err_last = err_alloc;
+            return NULL;
+        }
+
+        for (i = 0U; i < pool->cfg.max_conns; i++) {
+            atomic_init(&pool->cached[i].slot, NULL);
+        }
+    }
+
+    if (posix_memalign((void **)&pool->slots, DB_CACHE_LINE,
+                pool->cfg.max_conns * sizeof(*pool->slots)) != 0) {
+        pool->slots = NULL;
+        pool_free(pool);
+        err_last = err_alloc;
+        return NULL;
+    }
+
+    for (i = 0U; i < pool->cfg.max_conns; i++) {
+        atomic_init(&pool->slots[i].mysql_conn, NULL);
+    }
+    pool->conns_max = pool->cfg.max_conns;
+
+    pool->reap_buf = calloc(pool->cfg.max_conns, sizeof(*pool->reap_buf));
+    pool->check_buf = calloc(pool->cfg.max_conns, sizeof(*pool->check_buf));
+    if (!pool->reap_buf || !pool->check_buf) {
+        pool_free(pool);
+        err_last = err_alloc;
+        return NULL;
+    }
+
+    if (shards_init(pool, pool->cfg.shards ? pool->cfg.shards :
+                shard_default_count(pool->cfg.shard_by_node)) != 0) {
+        /* `err_last` is set by `shards_init` */
+        pool_free(pool);
+        return NULL;
+    }
+
+    for (i = 0U; i < pool->conns_max; i++) {
+        atomic_init(&pool->slots[i].state, SLOT_FREE);
+        atomic_init(&pool->slots[i].next, 0U);
+        pool->slots[i].index = (unsigned int)i;
+        pool->slots[i].shard = (unsigned int)i % pool->shards_max;
+        pool->slots[i].reserved = i < pool->cfg.reserved_conns;
+        pool->slots[i].pool = pool;
+        pool->slots[i].for_write = 0;
+        pool->slots[i].measured = 0;
+        pool->slots[i].generation = 0U;
+        pool->slots[i].acquired_ns = 0U;
+        pool->slots[i].released_ns = 0U;
+        pool->slots[i].checked_ns = 0U;
+        pool->slots[i].retire_ns = 0U;
+        pool->slots[i].async_op = ASYNC_NONE;
+        pool->slots[i].async_error = 0;
+        pool->slots[i].async_result = NULL;
+        pool->slots[i].streaming = 0;
+        pool->slots[i].arena = NULL;
+        pool->slots[i].arena_extra = NULL;
+        pool->slots[i].stmts = NULL;
+        pool->slots[i].stmt_count = 0U;
+        pool->slots[i].stmt_clock = 0U;
+        pool->slots[i].stmt_thread_id = 0U;
+        pool->slots[i].queries = NULL;
+    }
+
+    if (pthread_mutex_lock(&pool->mutex) != 0) {
+        pool_free(pool);
+        err_last = err_mutex;
+        return NULL;
+    }
+
+    if (pool_open(pool, 1) != 0) {
+        pthread_mutex_unlock(&pool->mutex);
+        pool_free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return pool;
+}
+
+static int pool_open(struct db_pool *pool, int is_first)
+{
+    size_t i;
+
+    if (is_first) {
+        if (pool->cfg.warmup != DB_WARMUP_BACKGROUND &&
+                conn_open_batch(pool, pool->cfg.min_conns,
+                    pool->cfg.warmup == DB_WARMUP_LAZY) != 0) {
+            err_last = err_connect;
+            return -1;
+        }
+
+        /*
+         * push in the reverse order to have the first slots on the top
+         */
+        for (i = pool->conns_max; i > 0U; i--) {
+            struct db_slot *slot = &pool->slots[i - 1U];
+
+            stack_push(slot_stack(slot), slot);
+        }
+    } else if (!pool->is_open && pool->is_drained) {
+        /*
+         * reuse the previously created connections
+         *
+         * we are setting the MYSQL_OPT_RECONNECT option when
+         * creating a connection so a simple ping should do a
+         * reconnect (given that the server is responding) if the
+         * connection was lost for some reason (i.e. timeout)
+         *
+         * the pool is drained while it is not open, so nobody else is
+         * using the connections
+         */
+        for (i = 0U; i < pool->conns_max; i++) {
+            MYSQL *mysql_conn = atomic_load(&pool->slots[i].mysql_conn);
+
+            if (mysql_conn && mysql_ping(mysql_conn) != 0) {
+                err_last = err_reconnect;
+                return -1;
+            }
+        }
+    }
+
+    if (pthread_rwlock_wrlock(&pool->rw_lock) != 0) {
+        err_last = err_rwlock;
+        return -1;
+    }
+
+    pool->is_closed = 0;
+    pool->is_drained = 0;
+    atomic_store_explicit(&pool->is_open, 1, memory_order_release);
+
+    pthread_rwlock_unlock(&pool->rw_lock);
+
+    /*
+     * a failure to start the thread is not fatal, the slots are
+     * connected on demand anyway
+     */
+    warm_start(pool);
+
+    /*
+     * neither is this one, the connections are then checked when the
+     * application pings them
+     */
+    maint_start(pool);
+
+    return 0;
+}
+
+static void pool_free(struct db_pool *pool)
+{
+    size_t i;
+
+    if (pool->slots) {
+        for (i = 0U; i < pool->conns_max; i++) {
+            if (atomic_load(&pool->slots[i].mysql_conn)) {
+                slot_disconnect(&pool->slots[i]);
+            }
+            free(pool->slots[i].stmts);
+            free(pool->slots[i].queries);
+            slot_arena_reset(&pool->slots[i]);
+            free(pool->slots[i].arena);
+        }
+    }
+
+    if (pool->shards) {
+        shards_free(pool);
+    }
+    free(pool->check_buf);
+    free(pool->reap_buf);
+    free(pool->cached);
+    free(pool->slots);
+    config_free(&pool->cfg);
+    free(pool->name);
+
+    pthread_cond_destroy(&pool->wait_drain);
+    pthread_mutex_destroy(&pool->wait_mutex);
+    pthread_cond_destroy(&pool->maint_cond);
+    pthread_mutex_destroy(&pool->maint_mutex);
+    pthread_cond_destroy(&pool->warm_cond);
+    pthread_mutex_destroy(&pool->warm_mutex);
+    pthread_rwlock_destroy(&pool->rw_lock);
+    pthread_mutex_destroy(&pool->mutex);
+
+    free(pool);
+}
+
+static void pool_link(struct db_pool *pool)
+{
+    pool->id = db_pool_next_id++;
+    pool->next = db_pools;
+    db_pools = pool;
+}
+
+static struct db_pool *pool_find(const char *name)
+{
+    struct db_pool *pool;
+
+    for (pool = db_pools; pool; pool = pool->next) {
+        if (pool->name && strcmp(pool->name, name) == 0) {
+            return pool;
+        }
+    }
+
+    return NULL;
+}
+
+static struct db_slot *pool_find_slot(struct db_pool *pool,
+        MYSQL *mysql_conn)
+{
+    unsigned int i;
+    unsigned int count;
+    struct db_slot *slot;
+
+    /*
+     * the connection of a busy slot changes only in the hands of its
+     * borrower, so the slot of `mysql_conn` can be found without a lock
+     */
+    for (i = 0U; i < pool->conns_max; i++) {
+        if (atomic_load_explicit(&pool->slots[i].mysql_conn,
+                    memory_order_relaxed) == mysql_conn) {
+            return &pool->slots[i];
+        }
+    }
+
+    count = atomic_load_explicit(&pool->replicas_count,
+            memory_order_acquire);
+    for (i = 0U; i < count; i++) {
+        slot = pool_find_slot(pool->replicas[i], mysql_conn);
+        if (slot) {
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+static uint64_t pool_score(struct db_pool *pool)
+{
+    /*
+     * every borrower ahead of us and we ourselves take the average
+     * time, the nanosecond keeps a replica which was not used yet from
+     * scoring zero regardless of its load
+     */
+    return ((uint64_t)atomic_load_explicit(&pool->in_flight,
+                memory_order_relaxed) + 1U) *
+        (atomic_load_explicit(&pool->latency_ns,
+                              memory_order_relaxed) + 1U);
+}
+
+static uint64_t deadline_from(uint64_t timeout_ns)
+{
+    uint64_t deadline_ns;
+
+    if (timeout_ns == 0U) {
+        return DEADLINE_POLL;
+    }
+
+    if (timeout_ns == DB_WAIT_FOREVER) {
+        return DEADLINE_NONE;
+    }
+
+    /*
+     * the deadline is computed once, so the time spent on the locks,
+     * on waiting and on the retries is all charged to the same budget
+     */
+    deadline_ns = now_ns();
+    if (timeout_ns >= DEADLINE_NONE - deadline_ns) {
+        return DEADLINE_NONE;
+    }
+
+    return deadline_ns + timeout_ns;
+}
+
+static struct db_pool *pool_default(void)
+{
+    struct db_pool *pool;
+
+    pool = atomic_load_explicit(&db_default, memory_order_acquire);
+    if (!pool) {
+        err_last = is_inited ? err_not_open : err_init;
+    }
+
+    return pool;
+}
+
+static int config_copy(struct db_config *dst, const struct db_config *src)
+{
+    *dst = *src;
+
+    dst->host = NULL;
+    dst->user = NULL;
+    dst->passwd = NULL;
+    dst->db = NULL;
+    dst->unix_socket = NULL;
+
+    if ((src->host && !(dst->host = strdup(src->host))) ||
+            (src->user && !(dst->user = strdup(src->user))) ||
+            (src->passwd && !(dst->passwd = strdup(src->passwd))) ||
+            (src->db && !(dst->db = strdup(src->db))) ||
+            (src->unix_socket &&
+                !(dst->unix_socket = strdup(src->unix_socket)))) {
+        config_free(dst);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void config_free(struct db_config *config)
+{
+    free((void *)config->host);
+    free((void *)config->user);
+    free((void *)config->passwd);
+    free((void *)config->db);
+    free((void *)config->unix_socket);
+
+    config->host = NULL;
+    config->user = NULL;
+    config->passwd = NULL;
+    config->db = NULL;
+    config->unix_socket = NULL;
+}
+
+static MYSQL *conn_open(struct db_pool *pool)
+{
+    const my_bool reconnect = 1; /* autoreconnect on ping */
+    MYSQL *mysql_conn;
+
+    mysql_conn = mysql_init(NULL);
+    if (!mysql_conn) {
+        return NULL;
+    }
+
+    if (mysql_options(mysql_conn, MYSQL_OPT_RECONNECT, &reconnect) != 0 ||
+#if defined(MYSQL_WAIT_READ)
+            (pool->cfg.nonblock &&
+             mysql_options(mysql_conn, MYSQL_OPT_NONBLOCK, 0) != 0) ||
+#endif
+            mysql_real_connect(mysql_conn, pool->cfg.host, pool->cfg.user,
+                pool->cfg.passwd, pool->cfg.db, pool->cfg.port,
+                pool->cfg.unix_socket, pool->cfg.client_flag) == NULL ||
+            mysql_autocommit(mysql_conn, pool->cfg.autocommit_mode) != 0) {
+        mysql_close(mysql_conn);
+        return NULL;
+    }
+
+    return mysql_conn;
+}
+
+static void stack_push(struct db_stack *stack, struct db_slot *slot)
+{
+    uint64_t head;
+    uint64_t new_head;
+    const uint32_t index = (uint32_t)slot->index + 1U;
+
+    head = atomic_load_explicit(&stack->head, memory_order_relaxed);
+    do {
+        atomic_store_explicit(&slot->next, (uint32_t)head,
+                memory_order_relaxed);
+        new_head = (((head >> 32) + 1U) << 32) | index;
+    } while (!atomic_compare_exchange_weak_explicit(&stack->head, &head,
+                new_head, memory_order_seq_cst, memory_order_relaxed));
+}
+
+static struct db_slot *stack_pop(struct db_pool *pool,
+        struct db_stack *stack)
+{
+    uint64_t head;
+    uint64_t new_head;
+    uint32_t index;
+
+    head = atomic_load_explicit(&stack->head, memory_order_seq_cst);
+    do {
+        index = (uint32_t)head;
+        if (index == 0U) {
+            return NULL;
+        }
+
+        /*
+         * `next` may be stale if the slot was popped in the meantime,
+         * but then the counter in `head` has changed and the
+         * compare-and-swap fails
+         */
+        new_head = (((head >> 32) + 1U) << 32) |
+            atomic_load_explicit(&pool->slots[index - 1U].next,
+                    memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&stack->head, &head,
+                new_head, memory_order_acquire, memory_order_acquire));
+
+    return &pool->slots[index - 1U];
+}
+
+static unsigned int stack_detach(struct db_pool *pool,
+        struct db_stack *stack, struct db_slot **buf)
+{
+    uint64_t head;
+    uint32_t index;
+    unsigned int count;
+
+    head = atomic_load(&stack->head);
+    while (!atomic_compare_exchange_weak(&stack->head, &head,
+                ((head >> 32) + 1U) << 32)) {
+    }
+
+    count = 0U;
+    for (index = (uint32_t)head; index != 0U;
+            index = atomic_load_explicit(&pool->slots[index - 1U].next,
+                memory_order_relaxed)) {
+        buf[count++] = &pool->slots[index - 1U];
+    }
+
+    return count;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        /* can not happen with a valid clock id */
+        return 0U;
+    }
+
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) +
+        (uint64_t)ts.tv_nsec;
+}
+
+static int slot_uncache(struct db_slot *slot)
+{
+    int expected = SLOT_CACHED;
+
+    return atomic_compare_exchange_strong(&slot->state, &expected,
+            SLOT_BUSY);
+}
+
+static int slot_release(struct db_slot *slot)
+{
+    struct db_pool *pool = slot->pool;
+    /*
+     * the oldest waiting thread gets the connection without going
+     * through the stack, so no other thread can take it in between
+     */
+    if (atomic_load(&pool->conns_waiters) && slot_handoff(slot)) {
+        return 0;
+    }
+
+    atomic_store_explicit(&slot->state, SLOT_FREE, memory_order_relaxed);
+
+    stack_push(slot_stack(slot), slot);
+
+    /*
+     * the push and this load are sequentially consistent and so are the
+     * increment of `conns_waiters` and the following pops in
+     * `slot_wait`, so either the waiting thread finds the slot or we
+     * see the waiting thread
+     */
+    if (atomic_load(&pool->conns_waiters)) {
+        slot_wake(pool);
+    }
+
+    return 0;
+}
+
+static struct db_stack *slot_stack(struct db_slot *slot)
+{
+    struct db_pool *pool = slot->pool;
+    if (slot->reserved) {
+        return &pool->conns_reserved;
+    }
+
+    return atomic_load_explicit(&slot->mysql_conn, memory_order_relaxed) ?
+        &pool->shards[slot->shard].free : &pool->conns_empty;
+}
+
+static struct db_slot *slot_steal(struct db_pool *pool)
+{
+    size_t i;
+
+    for (i = 0U; i < pool->conns_max; i++) {
+        if (atomic_load_explicit(&pool->slots[i].state, memory_order_relaxed) ==
+                SLOT_CACHED && slot_uncache(&pool->slots[i])) {
+            return &pool->slots[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int conn_open_batch(struct db_pool *pool, unsigned int count,
+        int tolerant)
+{
+    unsigned int i;
+    unsigned int threads;
+    pthread_t *tids;
+    struct conn_batch batch;
+
+    batch.pool = pool;
+    atomic_init(&batch.next, 0U);
+    atomic_init(&batch.failed, 0);
+    batch.count = count;
+    batch.tolerant = tolerant;
+
+    /*
+     * the calling thread connects too, so it needs one helper less
+     */
+    threads = pool->cfg.connect_threads < count ?
+        pool->cfg.connect_threads : count;
+    threads = threads > 1U ? threads - 1U : 0U;
+
+    tids = NULL;
+    if (threads > 0U) {
+        tids = calloc(threads, sizeof(*tids));
+        if (!tids) {
+            /* connect them one by one then */
+            threads = 0U;
+        }
+    }
+
+    for (i = 0U; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, conn_open_batch_run,
+                    &batch) != 0) {
+            /* the started threads and the calling one will do it */
+            threads = i;
+            break;
+        }
+    }
+
+    /*
+     * the calling thread is already initialized for the library, so it
+     * does not use `conn_open_batch_run` directly
+     */
+    while (!atomic_load(&batch.failed) &&
+            (i = atomic_fetch_add(&batch.next, 1U)) < count) {
+        if (slot_connect(&pool->slots[i]) != 0) {
+            if (tolerant) {
+                continue;
+            }
+
+            atomic_store(&batch.failed, 1);
+            break;
+        }
+    }
+
+    for (i = 0U; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    free(tids);
+
+    if (atomic_load(&batch.failed)) {
+        /*
+         * close all the connections
+         */
+        for (i = 0U; i < count; i++) {
+            if (atomic_load(&pool->slots[i].mysql_conn)) {
+                slot_disconnect(&pool->slots[i]);
+            }
+        }
+
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *conn_open_batch_run(void *arg)
+{
+    struct conn_batch *batch = arg;
+    struct db_pool *pool = batch->pool;
+    unsigned int i;
+
+    mysql_thread_init();
+
+    while (!atomic_load(&batch->failed) &&
+            (i = atomic_fetch_add(&batch->next, 1U)) < batch->count) {
+        if (slot_connect(&pool->slots[i]) != 0) {
+            if (batch->tolerant) {
+                continue;
+            }
+
+            atomic_store(&batch->failed, 1);
+            break;
+        }
+    }
+
+    mysql_thread_end();
+
+    return NULL;
+}
+
+static int warm_start(struct db_pool *pool)
+{
+    if (pool->cfg.warmup != DB_WARMUP_BACKGROUND || pool->warm_running) {
+        return 0;
+    }
+
+    if (pthread_create(&pool->warm_thread, NULL, warm_run, pool) != 0) {
+        err_last = err_thread;
+        return -1;
+    }
+
+    pool->warm_running = 1;
+
+    return 0;
+}
+
+static void warm_stop(struct db_pool *pool)
+{
+    if (!pool->warm_running) {
+        return;
+    }
+
+    /*
+     * locking the mutex makes sure the thread is either sleeping or
+     * checks `is_open` before it sleeps again
+     */
+    pthread_mutex_lock(&pool->warm_mutex);
+    pthread_cond_signal(&pool->warm_cond);
+    pthread_mutex_unlock(&pool->warm_mutex);
+
+    pthread_join(pool->warm_thread, NULL);
+
+    pool->warm_running = 0;
+}
+
+static void *warm_run(void *arg)
+{
+    struct db_pool *pool = arg;
+    struct db_slot *slot;
+    int result;
+    int reserved_done = 0;
+    struct timespec tmo_timespec;
+
+    mysql_thread_init();
+
+    while (atomic_load(&pool->is_open)) {
+        if (!reserved_done) {
+            /* the reserve is established first */
+            result = warm_reserved(pool);
+            reserved_done = result == 0;
+        } else {
+            if (atomic_load(&pool->conns_connected) >=
+                    pool->cfg.min_conns) {
+                break;
+            }
+
+            /*
+             * the slot is ours while it is out of the stack, a thread
+             * which needs it sooner connects another one on demand
+             */
+            slot = stack_pop(pool, &pool->conns_empty);
+            if (!slot) {
+                /* all of them are being connected on demand */
+                break;
+            }
+
+            atomic_store_explicit(&slot->state, SLOT_BUSY,
+                    memory_order_relaxed);
+
+            result = slot_connect(slot);
+
+            slot_release(slot);
+        }
+
+        if (result != 0) {
+            /*
+             * the server is not reachable, try again later
+             */
+            tmo_timespec = ns_to_timespec(now_ns() +
+                    (uint64_t)DB_WARMUP_RETRY_MS * UINT64_C(1000000));
+
+            pthread_mutex_lock(&pool->warm_mutex);
+            if (atomic_load(&pool->is_open)) {
+                pthread_cond_timedwait(&pool->warm_cond, &pool->warm_mutex,
+                        &tmo_timespec);
+            }
+            pthread_mutex_unlock(&pool->warm_mutex);
+        }
+    }
+
+    mysql_thread_end();
+
+    return NULL;
+}
+
+static int warm_reserved(struct db_pool *pool)
+{
+    unsigned int i;
+    int result = 0;
+    struct db_slot *slot;
+    struct db_stack taken;
+
+    atomic_init(&taken.head, 0U);
+
+    /*
+     * the reserved slots are kept aside until all of them were seen, so
+     * none is popped twice, they are ours like the borrowed ones in the
+     * meantime, a borrowed one is connected by its borrower
+     */
+    for (i = 0U; i < pool->cfg.reserved_conns; i++) {
+        slot = stack_pop(pool, &pool->conns_reserved);
+        if (!slot) {
+            break;
+        }
+
+        atomic_store_explicit(&slot->state, SLOT_BUSY,
+                memory_order_relaxed);
+
+        /* a failure does not keep the others from being connected */
+        if (!atomic_load_explicit(&slot->mysql_conn,
+                    memory_order_relaxed) && slot_connect(slot) != 0) {
+            result = -1;
+        }
+
+        stack_push(&taken, slot);
+    }
+
+    /*
+     * the failed ones go back empty, somebody may have started to wait
+     * for the reserve meanwhile and gets them first
+     */
+    while ((slot = stack_pop(pool, &taken)) != NULL) {
+        slot_release(slot);
+    }
+
+    return result;
+}
+
+static int maint_start(struct db_pool *pool)
+{
+    if (!pool->cfg.health_interval_ms || pool->maint_running) {
+        return 0;
+    }
+
+    if (pthread_create(&pool->maint_thread, NULL, maint_run, pool) != 0) {
+        err_last = err_thread;
+        return -1;
+    }
+
+    pool->maint_running = 1;
+
+    return 0;
+}
+
+static void maint_stop(struct db_pool *pool)
+{
+    if (!pool->maint_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->maint_mutex);
+    pthread_cond_signal(&pool->maint_cond);
+    pthread_mutex_unlock(&pool->maint_mutex);
+
+    pthread_join(pool->maint_thread, NULL);
+
+    pool->maint_running = 0;
+}
+
+static void *maint_run(void *arg)
+{
+    struct db_pool *pool = arg;
+    uint64_t now;
+    struct timespec tmo_timespec;
+    const uint64_t interval_ns = (uint64_t)pool->cfg.health_interval_ms *
+        UINT64_C(1000000);
+
+    mysql_thread_init();
+
+    for (;;) {
+        tmo_timespec = ns_to_timespec(now_ns() + interval_ns);
+
+        pthread_mutex_lock(&pool->maint_mutex);
+        if (atomic_load(&pool->is_open)) {
+            pthread_cond_timedwait(&pool->maint_cond, &pool->maint_mutex,
+                    &tmo_timespec);
+        }
+        pthread_mutex_unlock(&pool->maint_mutex);
+
+        if (!atomic_load(&pool->is_open)) {
+            break;
+        }
+
+        now = now_ns();
+
+        slots_check(pool, now);
+
+        /*
+         * the idle connections are closed even if nobody returns a
+         * connection to trigger it
+         */
+        if (pool->cfg.idle_timeout_ms) {
+            slots_reap_due(pool, now);
+        }
+    }
+
+    mysql_thread_end();
+
+    return NULL;
+}
+
+static struct db_slot *slot_get(struct db_pool *pool, unsigned int shard,
+        int grow, int priority)
+{
+    unsigned int i;
+    struct db_slot *slot;
+
+    /*
+     * prefer an established connection from our own shard, then from
+     * the neighbouring shards
+     */
+    for (i = 0U; i < pool->shards_max; i++) {
+        slot = stack_pop(pool,
+                &pool->shards[(shard + i) % pool->shards_max].free);
+        if (slot) {
+            goto found;
+        }
+    }
+
+    if (pool->cfg.thread_cache) {
+        slot = slot_steal(pool);
+        if (slot) {
+            /* it is SLOT_BUSY already */
+            return slot;
+        }
+    }
+
+    /*
+     * take an empty slot and connect it on demand, below `min_conns`
+     * or with no connection at all it is done without `grow` too,
+     * nobody may ever return a connection to wait for then
+     */
+    if (grow || atomic_load(&pool->conns_connected) < pool->cfg.min_conns ||
+            atomic_load(&pool->conns_connected) == 0U) {
+        slot = stack_pop(pool, &pool->conns_empty);
+        if (slot) {
+            goto found;
+        }
+    }
+
+    /*
+     * the reserve is the last resort, so it stays available for the
+     * high priority borrowers as long as possible
+     */
+    if (priority != DB_PRIO_INTERACTIVE) {
+        return NULL;
+    }
+
+    slot = stack_pop(pool, &pool->conns_reserved);
+    if (!slot) {
+        return NULL;
+    }
+
+found:
+    atomic_store_explicit(&slot->state, SLOT_BUSY, memory_order_relaxed);
+
+    return slot;
+}
+
+static struct db_slot *slot_wait(struct db_pool *pool, unsigned int shard,
+        uint64_t deadline_ns, int priority)
+{
+    struct db_waiter waiter;
+    struct db_slot *slot = NULL;
+    int result;
+    uint64_t grow_ns = DEADLINE_NONE;
+    uint64_t wake_ns;
+    struct timespec wake_timespec;
+
+    if (cond_init_monotonic(&waiter.cond) != 0) {
+        err_last = err_init_cond;
+        return NULL;
+    }
+
+    waiter.op = NULL;
+    waiter.slot = NULL;
+    waiter.shard = shard;
+    waiter.priority = priority;
+
+    /*
+     * the pool grows only if no connection is returned while we wait
+     * for `grow_wait_ms`, so short bursts are served by the existing
+     * connections
+     */
+    waiter.grow = pool->cfg.grow_wait_ms == 0U;
+    if (!waiter.grow) {
+        grow_ns = now_ns() +
+            (uint64_t)pool->cfg.grow_wait_ms * UINT64_C(1000000);
+    }
+
+    if (pthread_mutex_lock(&pool->wait_mutex) != 0) {
+        pthread_cond_destroy(&waiter.cond);
+        err_last = err_mutex;
+        return NULL;
+    }
+
+    /*
+     * the announcement makes the returning threads hand their slots
+     * over and skip their caches, and it happens before we look into
+     * the stacks again, so no returned slot can be missed
+     */
+    waiter_enqueue(pool, &waiter);
+    atomic_fetch_add(&pool->conns_waiters, 1U);
+
+    for (;;) {
+        if (waiter.slot) {
+            break;
+        }
+
+        if (!atomic_load(&pool->is_open)) {
+            err_last = err_not_open;
+            break;
+        }
+
+        /*
+         * only the first waiter takes the free slots from the stacks,
+         * the others wait for their turn
+         */
+        if (pool->wait_head == &waiter) {
+            slot = slot_get(pool, shard, waiter.grow, priority);
+            if (slot) {
+                break;
+            }
+        }
+
+        /* we wake up for whichever comes first, growing or giving up */
+        wake_ns = waiter.grow ? deadline_ns :
+                (grow_ns < deadline_ns ? grow_ns : deadline_ns);
+
+        if (wake_ns == DEADLINE_NONE) {
+            result = pthread_cond_wait(&waiter.cond, &pool->wait_mutex);
+        } else {
+            wake_timespec = ns_to_timespec(wake_ns);
+            result = pthread_cond_timedwait(&waiter.cond, &pool->wait_mutex,
+                    &wake_timespec);
+            if (result == ETIMEDOUT) {
+                result = 0;
+
+                if (waiter.slot) {
+                    /* handed over just in time */
+                    continue;
+                }
+
+                if (!waiter.grow && now_ns() >= grow_ns) {
+                    /* one more look into the stacks, growing this time */
+                    waiter.grow = 1;
+                } else if (now_ns() >= deadline_ns) {
+                    err_last = err_timeout;
+                    break;
+                }
+            }
+        }
+
+        if (result != 0) {
+            err_last = err_cond_wait;
+            break;
+        }
+    }
+
+    if (waiter.slot) {
+        slot = waiter.slot;
+    } else {
+        waiter_dequeue(pool, &waiter);
+    }
+
+    /* the next waiter may be the first one now */
+    if (pool->wait_head) {
+        waiter_notify(pool->wait_head);
+    }
+
+    atomic_fetch_sub(&pool->conns_waiters, 1U);
+
+    pthread_mutex_unlock(&pool->wait_mutex);
+
+    pthread_cond_destroy(&waiter.cond);
+
+    return slot;
+}
+
+static void slot_wake(struct db_pool *pool)
+{
+    struct db_waiter *waiter;
+    struct db_slot *slot;
+
+    if (pthread_mutex_lock(&pool->wait_mutex) != 0) {
+        return;
+    }
+
+    if (atomic_load(&pool->is_open)) {
+        while ((waiter = pool->wait_head) != NULL) {
+            slot = slot_get(pool, waiter->shard, waiter->grow,
+                    waiter->priority);
+            if (!slot) {
+                break;
+            }
+
+            waiter_dequeue(pool, waiter);
+            waiter->slot = slot;
+            waiter_notify(waiter);
+        }
+    } else {
+        for (waiter = pool->wait_head; waiter; waiter = waiter->next) {
+            waiter_notify(waiter);
+        }
+
+        pthread_cond_signal(&pool->wait_drain);
+    }
+
+    pthread_mutex_unlock(&pool->wait_mutex);
+}
+
+static int slot_handoff(struct db_slot *slot)
+{
+    struct db_pool *pool = slot->pool;
+    struct db_waiter *waiter;
+
+    if (pthread_mutex_lock(&pool->wait_mutex) != 0) {
+        return 0;
+    }
+
+    /*
+     * the empty slots are left to `slot_wake`, which knows whether
+     * the waiter may grow the pool already, and the reserved ones go
+     * back to the reserve unless the waiter may take them
+     */
+    waiter = pool->wait_head;
+    if (!waiter || !atomic_load(&pool->is_open) ||
+            !atomic_load_explicit(&slot->mysql_conn, memory_order_relaxed) ||
+            (slot->reserved && waiter->priority != DB_PRIO_INTERACTIVE)) {
+        pthread_mutex_unlock(&pool->wait_mutex);
+        return 0;
+    }
+
+    atomic_store_explicit(&slot->state, SLOT_BUSY, memory_order_relaxed);
+
+    waiter_dequeue(pool, waiter);
+    waiter->slot = slot;
+    waiter_notify(waiter);
+
+    pthread_mutex_unlock(&pool->wait_mutex);
+
+    return 1;
+}
+
+static void waiter_notify(struct db_waiter *waiter)
+{
+#if defined(DB_REACTOR)
+    if (waiter->op) {
+        op_ready(waiter->op);
+        return;
+    }
+#endif
+
+    pthread_cond_signal(&waiter->cond);
+}
+
+static void waiter_enqueue(struct db_pool *pool,
+        struct db_waiter *waiter)
+{
+    struct db_waiter *prev;
+
+    for (prev = pool->wait_tail; prev && prev->priority > waiter->priority;
+            prev = prev->prev) {
+    }
+
+    waiter->prev = prev;
+    waiter->next = prev ? prev->next : pool->wait_head;
+
+    if (waiter->next) {
+        waiter->next->prev = waiter;
+    } else {
+        pool->wait_tail = waiter;
+    }
+
+    if (prev) {
+        prev->next = waiter;
+    } else {
+        pool->wait_head = waiter;
+    }
+}
+
+static void waiter_dequeue(struct db_pool *pool,
+        struct db_waiter *waiter)
+{
+    if (waiter->prev) {
+        waiter->prev->next = waiter->next;
+    } else {
+        pool->wait_head = waiter->next;
+    }
+
+    if (waiter->next) {
+        waiter->next->prev = waiter->prev;
+    } else {
+        pool->wait_tail = waiter->prev;
+    }
+
+    waiter->next = NULL;
+    waiter->prev = NULL;
+}
+
+static unsigned int shard_current(struct db_pool *pool)
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned int cpu;
+    unsigned int node;
+#endif
+
+    if (pool->shards_max == 1U) {
+        return 0U;
+    }
+
+#if defined(__linux__) && defined(SYS_getcpu)
+    /*
+     * the system call works with any libc, unlike the `getcpu` and
+     * `sched_getcpu` wrappers
+     */
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+        return (pool->cfg.shard_by_node ? node : cpu) % pool->shards_max;
+    }
+#endif
+
+    return thread_number() % pool->shards_max;
+}
+
+static unsigned int thread_number(void)
+{
+    if (!thread_num) {
+        thread_num = atomic_fetch_add_explicit(&thread_num_next, 1U,
+                memory_order_relaxed) % (UINT_MAX - 1U) + 1U;
+    }
+
+    return thread_num - 1U;
+}
+
+static struct db_cached *thread_cached(struct db_pool *pool)
+{
+    return &pool->cached[thread_number() % pool->conns_max];
+}
+
+static unsigned int shard_default_count(int by_node)
+{
+    long result;
+
+#if defined(__linux__)
+    if (by_node) {
+        FILE *file;
+        char buf[256];
+        char *p;
+        unsigned long node;
+        unsigned long node_max = 0UL;
+
+        /*
+         * the file contains a list like "0-1,3", the nodes are counted
+         * up to the highest number
+         */
+        file = fopen("/sys/devices/system/node/online", "r");
+        if (!file) {
+            return 1U;
+        }
+
+        p = fgets(buf, sizeof(buf), file);
+        fclose(file);
+
+        while (p && *p) {
+            node = strtoul(p, &p, 10);
+            if (node > node_max) {
+                node_max = node;
+            }
+
+            if (*p == '-' || *p == ',') {
+                p++;
+            } else {
+                break;
+            }
+        }
+
+        return (unsigned int)node_max + 1U;
+    }
+#else
+    /* the NUMA nodes are known only on Linux */
+    if (by_node) {
+        return 1U;
+    }
+#endif
+
+    result = sysconf(_SC_NPROCESSORS_CONF);
+    if (result < 1L) {
+        return 1U;
+    }
+
+    return (unsigned int)result;
+}
+
+static int shards_init(struct db_pool *pool, unsigned int count)
+{
+    unsigned int i;
+
+    if (count > pool->cfg.max_conns) {
+        count = pool->cfg.max_conns;
+    }
+
+    if (posix_memalign((void **)&pool->shards, DB_CACHE_LINE,
+                count * sizeof(*pool->shards)) != 0) {
+        pool->shards = NULL;
+        err_last = err_alloc;
+        return -1;
+    }
+
+    for (i = 0U; i < count; i++) {
+        atomic_init(&pool->shards[i].free.head, 0U);
+    }
+
+    pool->shards_max = count;
+
+    return 0;
+}
+
+static void shards_free(struct db_pool *pool)
+{
+    free(pool->shards);
+    pool->shards = NULL;
+    pool->shards_max = 0U;
+}
+
+static int slot_connect(struct db_slot *slot)
+{
+    struct db_pool *pool = slot->pool;
+    MYSQL *mysql_conn;
+
+    mysql_conn = conn_open(pool);
+    if (!mysql_conn) {
+        return -1;
+    }
+
+    atomic_store_explicit(&slot->mysql_conn, mysql_conn,
+            memory_order_relaxed);
+    atomic_fetch_add(&pool->conns_connected, 1U);
+
+    if (pool->cfg.prepare_queries) {
+        slot_queries_prepare(slot);
+    }
+
+    /* a new connection is not idle */
+    slot->released_ns = now_ns();
+
+    if (pool->cfg.max_lifetime_ms) {
+        const uint64_t lifetime_ns = (uint64_t)pool->cfg.max_lifetime_ms *
+            UINT64_C(1000000);
+
+        slot->retire_ns = slot->released_ns + lifetime_ns -
+            mix64(slot->released_ns ^ ((uint64_t)slot->index << 32)) %
+            (lifetime_ns / 4U + 1U);
+    }
+
+    return 0;
+}
+
+static void slot_disconnect(struct db_slot *slot)
+{
+    struct db_pool *pool = slot->pool;
+
+    slot_stmts_free(slot);
+
+    mysql_close(atomic_load_explicit(&slot->mysql_conn,
+                memory_order_relaxed));
+
+    atomic_store_explicit(&slot->mysql_conn, NULL, memory_order_relaxed);
+    atomic_fetch_sub(&pool->conns_connected, 1U);
+}
+
+static MYSQL_STMT *slot_stmt(struct db_slot *slot, const char *sql,
+        unsigned long length, uint64_t hash)
+{
+    unsigned int i;
+    struct db_stmt *entry;
+    MYSQL_STMT *stmt;
+    MYSQL *mysql_conn = atomic_load_explicit(&slot->mysql_conn,
+            memory_order_relaxed);
+    const unsigned int size = slot->pool->cfg.stmt_cache_size;
+
+    if (!size) {
+        err_last = err_no_cache;
+        return NULL;
+    }
+
+    slot_stmts_sync(slot, mysql_conn);
+
+    slot->stmt_clock++;
+
+    for (i = 0U; i < slot->stmt_count; i++) {
+        entry = &slot->stmts[i];
+        if (entry->hash == hash && entry->length == length &&
+                memcmp(entry->sql, sql, length) == 0) {
+            entry->used = slot->stmt_clock;
+            return entry->stmt;
+        }
+    }
+
+    if (!slot->stmts) {
+        slot->stmts = calloc(size, sizeof(*slot->stmts));
+        if (!slot->stmts) {
+            err_last = err_alloc;
+            return NULL;
+        }
+    }
+
+    stmt = mysql_stmt_init(mysql_conn);
+    if (!stmt) {
+        err_last = err_alloc;
+        return NULL;
+    }
+
+    if (mysql_stmt_prepare(stmt, sql, length) != 0) {
+        mysql_stmt_close(stmt);
+        err_last = err_prepare;
+        return NULL;
+    }
+
+    /*
+     * take a free entry or the least recently used one
+     */
+    if (slot->stmt_count < size) {
+        entry = &slot->stmts[slot->stmt_count++];
+    } else {
+        entry = &slot->stmts[0];
+        for (i = 1U; i < size; i++) {
+            if (slot->stmts[i].used < entry->used) {
+                entry = &slot->stmts[i];
+            }
+        }
+
+        mysql_stmt_close(entry->stmt);
+        free(entry->sql);
+    }
+
+    entry->stmt = stmt;
+    entry->sql = malloc(length ? length : 1U);
+    if (!entry->sql) {
+        /* drop the entry, it is the last one then */
+        mysql_stmt_close(stmt);
+        *entry = slot->stmts[--slot->stmt_count];
+        err_last = err_alloc;
+        return NULL;
+    }
+    memcpy(entry->sql, sql, length);
+    entry->length = length;
+    entry->hash = hash;
+    entry->used = slot->stmt_clock;
+
+    return stmt;
+}
+
+static MYSQL_STMT *slot_query(struct db_slot *slot, unsigned int id)
+{
+    MYSQL_STMT *stmt;
+    MYSQL *mysql_conn = atomic_load_explicit(&slot->mysql_conn,
+            memory_order_relaxed);
+
+    slot_stmts_sync(slot, mysql_conn);
+
+    if (slot->queries && slot->queries[id]) {
+        return slot->queries[id];
+    }
+
+    if (!slot->queries) {
+        slot->queries = calloc(DB_QUERIES_MAX, sizeof(*slot->queries));
+        if (!slot->queries) {
+            err_last = err_alloc;
+            return NULL;
+        }
+    }
+
+    stmt = mysql_stmt_init(mysql_conn);
+    if (!stmt) {
+        err_last = err_alloc;
+        return NULL;
+    }
+
+    if (mysql_stmt_prepare(stmt, db_queries[id].sql,
+                db_queries[id].length) != 0) {
+        mysql_stmt_close(stmt);
+        err_last = err_prepare;
+        return NULL;
+    }
 
-/*
- * please check the functions comments in the header file
- */
+    slot->queries[id] = stmt;
 
-void db_thread_init(void)
+    return stmt;
+}
+
+static void slot_queries_prepare(struct db_slot *slot)
 {
-    mysql_thread_init();
+    unsigned int i;
+    const unsigned int count = atomic_load_explicit(&db_queries_count,
+            memory_order_acquire);
+
+    for (i = 0U; i < count; i++) {
+        if (!slot_query(slot, i)) {
+            /* the others would most likely fail the same way */
+            break;
+        }
+    }
 }
 
-void db_thread_end(void)
+static void slot_stmts_sync(struct db_slot *slot, MYSQL *mysql_conn)
 {
-    mysql_thread_end();
+    const unsigned long thread_id = mysql_thread_id(mysql_conn);
+
+    /*
+     * a reconnect made by the MYSQL_OPT_RECONNECT option is noticed by
+     * the new server thread id, the old statements are gone then
+     */
+    if (thread_id != slot->stmt_thread_id) {
+        slot_stmts_free(slot);
+        slot->stmt_thread_id = thread_id;
+    }
 }
 
-const char *db_error(void)
+static void slot_stmts_free(struct db_slot *slot)
 {
-    if (err_last) {
-        return err_last;
+    unsigned int i;
+
+    for (i = 0U; i < slot->stmt_count; i++) {
+        mysql_stmt_close(slot->stmts[i].stmt);
+        free(slot->stmts[i].sql);
     }
 
-    if (!is_thread_safe) {
-        return err_not_thread_safe;
+    slot->stmt_count = 0U;
+
+    if (slot->queries) {
+        for (i = 0U; i < DB_QUERIES_MAX; i++) {
+            if (slot->queries[i]) {
+                mysql_stmt_close(slot->queries[i]);
+                slot->queries[i] = NULL;
+            }
+        }
     }
+}
 
-    if (!is_inited) {
-        return  err_not_inited;
+static void slot_stream_abort(struct db_slot *slot, MYSQL_RES *res)
+{
+    unsigned int i;
+    MYSQL *mysql_conn = atomic_load_explicit(&slot->mysql_conn,
+            memory_order_relaxed);
+
+    for (i = 0U; i < slot->pool->cfg.stream_drain_rows; i++) {
+        if (!mysql_fetch_row(res)) {
+            if (mysql_errno(mysql_conn) == 0U) {
+                /* the result set ended, the connection can be reused */
+                mysql_free_result(res);
+                return;
+            }
+
+            break;
+        }
     }
 
-    if (pthread_rwlock_rdlock(&db_rw_lock) != 0) {
-        return err_rwlock;
+    /*
+     * `mysql_free_result` reads the rest of the result set, a closed
+     * socket makes it return at once and the server abort the query
+     */
+    shutdown(mysql_get_socket(mysql_conn), SHUT_RDWR);
+    mysql_free_result(res);
+
+    slot->streaming = 1;
+}
+
+static struct db_chunk *chunk_new(size_t size)
+{
+    struct db_chunk *chunk;
+
+    if (size > SIZE_MAX - sizeof(*chunk)) {
+        return NULL;
     }
 
-    if (!is_open) {
-        pthread_rwlock_unlock(&db_rw_lock);
-        return err_not_open;
+    chunk = malloc(sizeof(*chunk) + size);
+    if (!chunk) {
+        return NULL;
     }
 
-    pthread_rwlock_unlock(&db_rw_lock);
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0U;
 
-    return err_unknown;
+    return chunk;
 }
 
-int db_open(const char *host,
-            const char *user,
-            const char *passwd,
-            const char *db,
-            unsigned int port,
-            const char *unix_socket,
-            unsigned long client_flag,
-            my_bool autocommit_mode)
+static void slot_arena_reset(struct db_slot *slot)
 {
-    size_t i;
+    struct db_chunk *chunk;
 
-    if (!is_inited) {
-        if (!mysql_thread_safe()) {
-            is_thread_safe = 0;
-            return -1;
-        }
+    while (slot->arena_extra) {
+        chunk = slot->arena_extra;
+        slot->arena_extra = chunk->next;
+        free(chunk);
+    }
 
-        is_thread_safe = 1;
+    if (slot->arena) {
+        slot->arena->used = 0U;
+    }
+}
 
-        if (mysql_library_init(0, NULL, NULL) != 0) {
-            err_last = err_init_lib;
-            return -1;
-        }
+static void bind_move(MYSQL_BIND *bind, unsigned int columns,
+        ptrdiff_t offset)
+{
+    unsigned int i;
 
-        if (pthread_mutex_init(&db_mutex, NULL) != 0) {
-            err_last = err_init_mutex;
-            return -1;
+    for (i = 0U; i < columns; i++) {
+        if (bind[i].buffer) {
+            bind[i].buffer = (char *)bind[i].buffer + offset;
         }
 
-        if (pthread_rwlock_init(&db_rw_lock, NULL) != 0) {
-            pthread_mutex_destroy(&db_mutex);
-            err_last = err_init_rwlock;
-            return -1;
+        if (bind[i].length) {
+            bind[i].length = (unsigned long *)(void *)
+                ((char *)bind[i].length + offset);
         }
 
-        if (sem_init(&db_sem, 0, DB_POOL_CONN_COUNT) != 0) {
-            pthread_rwlock_destroy(&db_rw_lock);
-            pthread_mutex_destroy(&db_mutex);
-            err_last = err_init_semaphore;
-            return -1;
+        if (bind[i].is_null) {
+            bind[i].is_null = (my_bool *)(void *)
+                ((char *)bind[i].is_null + offset);
         }
 
-        is_inited = 1;
+        if (bind[i].error) {
+            bind[i].error = (my_bool *)(void *)
+                ((char *)bind[i].error + offset);
+        }
     }
+}
 
-    if (pthread_mutex_lock(&db_mutex) != 0) {
-        err_last = err_mutex;
-        return -1;
+static uint64_t hash_fnv1a(const char *data, unsigned long length)
+{
+    unsigned long i;
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+    for (i = 0U; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= UINT64_C(0x100000001b3);
     }
 
-    for (i = 0U; i < DB_POOL_CONN_COUNT; i++) {
-        if (!mysql_conns[i]) {
-            const my_bool reconnect = 1; /* autoreconnect on ping */
+    return hash;
+}
 
-            mysql_conns[i] = mysql_init(NULL);
-            if (!mysql_conns[i] ||
-                    mysql_options(mysql_conns[i], MYSQL_OPT_RECONNECT,
-                        &reconnect) != 0 ||
-                    mysql_real_connect(mysql_conns[i], host,
-                        user, passwd, db, port, unix_socket,
-                        client_flag) == NULL ||
-                    mysql_autocommit(mysql_conns[i],
-                        autocommit_mode) != 0) {
-                /*
-                 * close all the connections
-                 */
-                for (;;) {
-                    if (mysql_conns[i]) {
-                        mysql_close(mysql_conns[i]);
-                        mysql_conns[i] = NULL;
-                    }
+static uint64_t slot_idle_ns(const struct db_slot *slot, uint64_t now)
+{
+    const uint64_t used_ns = slot->released_ns > slot->checked_ns ?
+        slot->released_ns : slot->checked_ns;
 
-                    if (i == 0U) {
-                        break;
-                    } else {
-                        i--;
-                    }
-                }
-                pthread_mutex_unlock(&db_mutex);
+    return now > used_ns ? now - used_ns : 0U;
+}
 
-                err_last = err_connect;
-                return -1;
-            }
-        } else {
-            /*
-             * reuse a previously created connection
-             *
-             * we are setting the MYSQL_OPT_RECONNECT option when
-             * creating a connection so a simple ping should do a
-             * reconnect (given that the server is responding) if the
-             * connection was lost for some reason (i.e. timeout)
-             */
-            if (mysql_ping(mysql_conns[i]) != 0) {
-                pthread_mutex_unlock(&db_mutex);
+static int slot_check(struct db_slot *slot)
+{
+    /*
+     * the MYSQL_OPT_RECONNECT option makes the ping reconnect by
+     * itself, so a failure means the server is not reachable right
+     * now, try once more with a new connection
+     */
+    if (mysql_ping(atomic_load_explicit(&slot->mysql_conn,
+                    memory_order_relaxed)) != 0) {
+        slot_disconnect(slot);
 
-                err_last = err_reconnect;
-                return -1;
-            }
+        if (slot_connect(slot) != 0) {
+            return -1;
         }
     }
 
-    if (pthread_rwlock_wrlock(&db_rw_lock) != 0) {
-        pthread_mutex_unlock(&db_mutex);
+    slot->checked_ns = now_ns();
 
-        err_last = err_rwlock;
-        return -1;
-    }
+    return 0;
+}
 
-    is_open = 1;
-    is_closed = 0;
+static int slot_renew(struct db_slot *slot)
+{
+    slot_disconnect(slot);
 
-    pthread_rwlock_unlock(&db_rw_lock);
+    return slot_connect(slot);
+}
 
-    pthread_mutex_unlock(&db_mutex);
+static uint64_t mix64(uint64_t x)
+{
+    /* the splitmix64 finalizer */
+    x ^= x >> 30;
+    x *= UINT64_C(0xbf58476d1ce4e5b9);
+    x ^= x >> 27;
+    x *= UINT64_C(0x94d049bb133111eb);
+    x ^= x >> 31;
 
-    return 0;
+    return x;
 }
 
-int db_close(void)
+static void slots_reap(struct db_pool *pool, uint64_t now)
 {
-    size_t i;
-    int ready;
+    unsigned int i;
+    unsigned int count;
+    unsigned int total;
+    unsigned int reaped;
+    struct db_slot *slot;
+    const uint64_t idle_ns = (uint64_t)pool->cfg.idle_timeout_ms *
+        UINT64_C(1000000);
 
-    if (!is_inited) {
-        err_last = err_init;
-        return -1;
+    if (pool->cfg.thread_cache) {
+        slots_uncache_stale(pool, now, idle_ns);
     }
 
-    if (pthread_rwlock_wrlock(&db_rw_lock) != 0) {
-        err_last = err_rwlock;
-        return -1;
-    }
+    for (i = 0U; i < pool->shards_max; i++) {
+        struct db_stack *stack = &pool->shards[i].free;
 
-    if (is_closed) {
-        pthread_rwlock_unlock(&db_rw_lock);
-        return 0;
-    }
+        /*
+         * detach the whole stack, the slots are ours then, the other
+         * threads will steal from the other shards for this short while
+         */
+        count = stack_detach(pool, stack, pool->reap_buf);
 
-    /*
-     * after this the `db_get_conn` function won't return any more
-     * connections from the pool until `is_open` becomes 1
-     *
-     * by setting the `is_closed` to 1 we can inform the application
-     * the connections was closed intentionally and there is no need
-     * to reconnect
-     */
-    is_open = 0;
-    is_closed = 1;
+        /*
+         * the most recently used slots are on the top, so the idle ones
+         * are at the end of the buffer, push the rest back starting
+         * from the bottom to keep the order, the idle ones are moved to
+         * the already processed end of the buffer
+         */
+        total = count;
+        reaped = 0U;
+        while (count > 0U) {
+            slot = pool->reap_buf[--count];
 
-    pthread_rwlock_unlock(&db_rw_lock);
+            /*
+             * a slot may have been returned after `now` was read, so
+             * `released_ns` can be later than `now`, the health checks
+             * do not count as a use here
+             */
+            if (slot->released_ns + idle_ns < now &&
+                    atomic_load(&pool->conns_connected) - reaped >
+                    pool->cfg.min_conns) {
+                pool->reap_buf[total - ++reaped] = slot;
+                continue;
+            }
 
-    /*
-     * try to wait for all the connections from the pool that are being
-     * used and close them
-     *
-     * no more connections will be returned from the pool by the
-     * `db_get_conn` funtion until `db_connect` is called again
-     */
-    ready = 0;
-    while (!ready) {
-        for (i = 0U; i < DB_POOL_CONN_COUNT; i++) {
-            ready = 1;
+            stack_push(stack, slot);
+        }
 
-            if (pthread_mutex_lock(&db_mutex) != 0) {
-                err_last = err_mutex;
-                return -1;
-            }
-            if (mysql_conns_busy[i] == 1) {
-                pthread_mutex_unlock(&db_mutex);
+        /*
+         * somebody may have started to wait while the stack was empty
+         */
+        if (atomic_load(&pool->conns_waiters)) {
+            slot_wake(pool);
+        }
 
-                if (sem_wait(&db_sem) != 0) {
-                    err_last = err_semaphore_wait;
-                    return -1;
-                }
-                ready = 0;
-            } else {
-                pthread_mutex_unlock(&db_mutex);
-            }
+        while (reaped > 0U) {
+            slot = pool->reap_buf[total - reaped--];
 
-            if (!ready) {
-                break;
-            }
+            slot_disconnect(slot);
+            slot_release(slot);
         }
     }
-
-    return 0;
 }
 
-int db_is_open(void) {
-    int result;
+static void slots_uncache_stale(struct db_pool *pool, uint64_t now,
+        uint64_t idle_ns)
+{
+    unsigned int i;
+    struct db_slot *slot;
 
-    if (!is_inited) {
-        return 0;
-    }
+    for (i = 0U; i < pool->conns_max; i++) {
+        slot = &pool->slots[i];
 
-    if (pthread_rwlock_rdlock(&db_rw_lock) != 0) {
-        err_last = err_rwlock;
-        return -1;
-    }
+        /* the slot is ours only after it was taken from the cache */
+        if (atomic_load(&slot->state) != SLOT_CACHED ||
+                !slot_uncache(slot)) {
+            continue;
+        }
 
-    result = is_open;
+        if (slot->released_ns + idle_ns < now ||
+                (pool->cfg.max_lifetime_ms && now >= slot->retire_ns)) {
+            slot_release(slot);
+            continue;
+        }
 
-    pthread_rwlock_unlock(&db_rw_lock);
+        /*
+         * still fresh, so it goes back to the cache, the entry of the
+         * thread still points to it, but it is handed over if somebody
+         * started to wait or the pool is closing meanwhile, like in
+         * `db_post_handle`
+         */
+        atomic_store(&slot->state, SLOT_CACHED);
 
-    return result;
+        if ((atomic_load(&pool->conns_waiters) ||
+                    !atomic_load(&pool->is_open)) && slot_uncache(slot)) {
+            slot_release(slot);
+        }
+    }
 }
 
-int db_is_closed(void)
+static void slots_reap_due(struct db_pool *pool, uint64_t now)
 {
-    int result;
+    uint64_t reap_ns;
 
-    if (!is_inited) {
-        return 1;
+    /*
+     * check the idle connections about twice per timeout, the thread
+     * which wins the exchange does the check
+     */
+    reap_ns = atomic_load_explicit(&pool->reap_next_ns, memory_order_relaxed);
+    if (now < reap_ns) {
+        return;
     }
 
-    if (pthread_rwlock_rdlock(&db_rw_lock) != 0) {
-        err_last = err_rwlock;
-        return -1;
+    /*
+     * closing a connection can block on a dead peer, so the previous
+     * check may still be running with `reap_buf`
+     */
+    if (atomic_flag_test_and_set_explicit(&pool->reap_running,
+                memory_order_acquire)) {
+        return;
     }
 
-    result = is_closed;
-
-    pthread_rwlock_unlock(&db_rw_lock);
+    if (atomic_compare_exchange_strong(&pool->reap_next_ns, &reap_ns,
+                now + (uint64_t)pool->cfg.idle_timeout_ms *
+                UINT64_C(500000))) {
+        slots_reap(pool, now);
+    }
 
-    return result;
+    atomic_flag_clear_explicit(&pool->reap_running, memory_order_release);
 }
 
-MYSQL *db_get_conn(void)
+static void slots_check(struct db_pool *pool, uint64_t now)
 {
-    size_t i;
-    struct timespec tmo_timespec;
-    MYSQL *mysql_conn = NULL;
+    unsigned int i;
 
-    if (!is_inited) {
-        err_last = err_init;
-        return NULL;
+    if (pool->cfg.thread_cache) {
+        slots_uncache_stale(pool, now,
+                (uint64_t)pool->cfg.health_interval_ms * UINT64_C(1000000));
     }
 
-    if (pthread_rwlock_rdlock(&db_rw_lock) != 0) {
-        err_last = err_rwlock;
-        return NULL;
+    for (i = 0U; i < pool->shards_max; i++) {
+        slots_check_stack(pool, &pool->shards[i].free, now);
     }
 
-    if (!is_open) {
-        pthread_rwlock_unlock(&db_rw_lock);
+    slots_check_stack(pool, &pool->conns_reserved, now);
+}
 
-        err_last = err_not_open;
-        return NULL;
-    }
+static void slots_check_stack(struct db_pool *pool, struct db_stack *stack,
+        uint64_t now)
+{
+    unsigned int i;
+    unsigned int count;
+    unsigned int total;
+    unsigned int stale;
+    unsigned int kept;
+    struct db_slot *slot;
+    MYSQL *mysql_conn;
+    struct db_slot **buf = pool->check_buf;
+    const uint64_t interval_ns = (uint64_t)pool->cfg.health_interval_ms *
+        UINT64_C(1000000);
 
-    pthread_rwlock_unlock(&db_rw_lock);
+    count = stack_detach(pool, stack, buf);
 
-    if (sem_wait(&db_sem) != 0) {
-        err_last = err_semaphore_wait;
-        return NULL;
-    }
+    /*
+     * push the recently used slots back in their order and move the
+     * stale ones to the end of the buffer like `slots_reap` does, the
+     * empty reserved slots are connected on demand and are skipped
+     */
+    total = count;
+    stale = 0U;
+    while (count > 0U) {
+        slot = buf[--count];
+        mysql_conn = atomic_load_explicit(&slot->mysql_conn,
+                memory_order_relaxed);
 
-    if (clock_gettime(CLOCK_REALTIME, &tmo_timespec) != 0) {
-        err_last = err_clock_gettime;
-        if (sem_post(&db_sem) != 0) {
-            /* ignore the error, we are already in erroneous state */
+        if (mysql_conn && (slot_idle_ns(slot, now) >= interval_ns ||
+                    (pool->cfg.max_lifetime_ms && now >= slot->retire_ns))) {
+            buf[total - ++stale] = slot;
+            continue;
         }
-        return NULL;
+
+        stack_push(stack, slot);
     }
 
-    tmo_timespec.tv_sec += DEFAULT_MUTEX_TIMEOUT_SEC;
-    if (pthread_mutex_timedlock(&db_mutex, &tmo_timespec) != 0) {
-        err_last = err_mutex;
-        if (sem_post(&db_sem) != 0) {
-            /* ignore the error, we are already in erroneous state */
-        }
-        return NULL;
+    if (atomic_load(&pool->conns_waiters)) {
+        slot_wake(pool);
     }
 
-    if (pthread_rwlock_rdlock(&db_rw_lock) != 0) {
-        err_last = err_rwlock;
-        return NULL;
+    if (!stale) {
+        return;
     }
 
     /*
-     * checking another time because it's possible that db_close was
-     * working while we were waiting on the mutex or a connection was
-     * closed for another reason
+     * ping them starting from the bottom one, the good ones are
+     * collected at the end of the buffer, which never overwrites a
+     * slot not processed yet
      */
-    if (!is_open) {
-        pthread_rwlock_unlock(&db_rw_lock);
-        pthread_mutex_unlock(&db_mutex);
+    kept = 0U;
+    for (i = total; i > total - stale; i--) {
+        slot = buf[i - 1U];
 
-        err_last = err_not_open;
-        if (sem_post(&db_sem) != 0) {
-            /* ignore the error, we are already in erroneous state */
+        /*
+         * an old connection is replaced without the ping, a connection
+         * which can not be replaced leaves the slot empty, it goes to
+         * `conns_empty` then
+         */
+        if (atomic_load(&pool->is_open) &&
+                (pool->cfg.max_lifetime_ms && now >= slot->retire_ns ?
+                 slot_renew(slot) : slot_check(slot)) != 0) {
+            slot_release(slot);
+            continue;
         }
-        return NULL;
-    }
-
-    pthread_rwlock_unlock(&db_rw_lock);
 
-    for (i = 0U; i < DB_POOL_CONN_COUNT; i++) {
-        if (!mysql_conns_busy[i]) {
-            mysql_conns_busy[i] = 1;
-            mysql_conn = mysql_conns[i];
-            break;
-        }
+        buf[pool->conns_max - ++kept] = slot;
     }
 
-    if (!mysql_conn) {
-        pthread_mutex_unlock(&db_mutex);
-        err_last = err_no_free_slot_bug;
-        if (sem_post(&db_sem) != 0) {
-            /* ignore the error, we are already in erroneous state */
-        }
-        return NULL;
+    if (!kept) {
+        return;
     }
 
-    pthread_mutex_unlock(&db_mutex);
-
-
-    return mysql_conn;
-}
-
-int db_post_conn(MYSQL *mysql_conn)
-{
-    size_t i;
-    int found;
-
-    if (!is_inited) {
-        err_last = err_init;
-        return -1;
-    }
+    /*
+     * the checked slots were idle, so they go back below the ones
+     * returned in the meantime to keep the least recently used ones at
+     * the bottom
+     */
+    count = stack_detach(pool, stack, buf);
 
-    if (!mysql_conn) {
-        err_last = err_input;
-        return -1;
+    for (i = pool->conns_max; i > pool->conns_max - kept; i--) {
+        stack_push(stack, buf[i - 1U]);
     }
 
-    if (pthread_mutex_lock(&db_mutex) != 0) {
-        err_last = err_mutex;
-        return -1;
+    while (count > 0U) {
+        stack_push(stack, buf[--count]);
     }
 
-    for (i = 0U, found = 0; i < DB_POOL_CONN_COUNT; i++) {
-        if (mysql_conns_busy[i]) {
-            mysql_conns[i] = mysql_conn;
-            mysql_conns_busy[i] = 0;
-            found = 1;
-            break;
-        }
+    if (atomic_load(&pool->conns_waiters)) {
+        slot_wake(pool);
     }
+}
 
-    if (!found) {
-        pthread_mutex_unlock(&db_mutex);
+static int cond_init_monotonic(pthread_cond_t *cond)
+{
+    int result;
+    pthread_condattr_t attr;
 
-        err_last = err_no_busy_slot_bug;
-        return -1;
+    result = pthread_condattr_init(&attr);
+    if (result != 0) {
+        return result;
     }
 
-    pthread_mutex_unlock(&db_mutex);
-
-    if (sem_post(&db_sem) != 0) {
-        err_last = err_semaphore_post;
-        return -1;
+    result = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (result == 0) {
+        result = pthread_cond_init(cond, &attr);
     }
 
-    return 0;
+    pthread_condattr_destroy(&attr);
+
+    return result;
 }
 
-int db_ping(MYSQL *mysql_conn)
+static struct timespec ns_to_timespec(uint64_t ns)
 {
-    if (!is_inited) {
-        err_last = err_init;
-        return -1;
-    }
-
-    if (!mysql_conn) {
-        err_last = err_input;
-        return -1;
-    }
+    struct timespec ts;
 
-    if (mysql_ping(mysql_conn) != 0) {
-        err_last = err_ping;
-        return -1;
-    }
+    ts.tv_sec = (time_t)(ns / UINT64_C(1000000000));
+    ts.tv_nsec = (long)(ns % UINT64_C(1000000000));
 
-    return 0;
+    return ts;
 }
@@ -22,14 +22,94 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+#include <stdint.h>
 #include <mysql.h>
 
-/* the number of connections in the database pool */
+/*
+ * the default number of connections in the database pool, used by
+ * `db_open` and `db_config_init`
+ */
 #define DB_POOL_CONN_COUNT        (8U)
 
-/* how long (in seconds) should we wait for a mutex before a timeout */
+/*
+ * the default maximum number of threads establishing the connections
+ * in parallel, used by `db_config_init`
+ */
+#define DB_CONNECT_THREADS        (16U)
+
+/*
+ * how long (in milliseconds) the background warm-up waits before it
+ * tries to connect again after a failure
+ */
+#define DB_WARMUP_RETRY_MS        (1000U)
+
+/*
+ * the warm-up modes, see the `warmup` field of `db_config`
+ */
+#define DB_WARMUP_EAGER           (0)
+#define DB_WARMUP_LAZY            (1)
+#define DB_WARMUP_BACKGROUND      (2)
+
+/*
+ * the borrower priorities, see `db_get_conn_prio`, the waiting
+ * borrowers are served in this order
+ */
+#define DB_PRIO_INTERACTIVE       (0)
+#define DB_PRIO_BATCH             (1)
+#define DB_PRIO_BACKGROUND        (2)
+
+/* the timeout of `db_get_conn_prio` which never expires */
+#define DB_WAIT_FOREVER           (UINT64_MAX)
+
+/*
+ * the access modes of `db_get_conn_for`
+ */
+#define DB_READ                   (1)
+#define DB_WRITE                  (2)
+
+/* the maximum number of replicas of a pool */
+#define DB_POOL_REPLICAS_MAX      (16U)
+
+/*
+ * the default number of prepared statements cached per connection,
+ * used by `db_config_init`
+ */
+#define DB_STMT_CACHE_SIZE        (16U)
+
+/* the maximum number of queries `db_register_query` can register */
+#define DB_QUERIES_MAX            (256U)
+
+/*
+ * the number of the remaining rows `db_stream_query` reads and discards
+ * when it stops early before it gives up on the connection
+ */
+#define DB_STREAM_DRAIN_ROWS      (1024U)
+
+/* the size of the memory block every connection keeps for its arena */
+#define DB_ARENA_SIZE             (16384U)
+
+/*
+ * not used anymore, the acquire timeouts are passed to
+ * `db_get_conn_timed` and `db_get_handle_timed`, kept only for the
+ * existing code which refers to it
+ */
 #define DEFAULT_MUTEX_TIMEOUT_SEC (30)
 
+/*
+ * an opaque handle of a borrowed pool connection, see `db_get_handle`
+ */
+typedef struct db_slot db_handle_t;
+
+/*
+ * an opaque pool of connections, see `db_pool_create`
+ *
+ * every pool has its own connections, settings and limits, the `db_`
+ * functions without a pool argument use the default pool created by
+ * `db_open_config`
+ */
+typedef struct db_pool db_pool_t;
+
 /*
  * all threads must call this function before calling any other
  * functions
@@ -67,6 +147,261 @@ int db_open(const char *host,
             unsigned long client_flag,
             my_bool autocommit_mode);
 
+/*
+ * the database pool settings for `db_open_config`
+ *
+ * please use `db_config_init` to fill the structure with the default
+ * values before setting the fields you need
+ */
+struct db_config {
+    /*
+     * the connection parameters, please see the mysql_real_connect
+     * documentation, the strings are copied by `db_open_config`
+     */
+    const char *host;
+    const char *user;
+    const char *passwd;
+    const char *db;
+    unsigned int port;
+    const char *unix_socket;
+    unsigned long client_flag;
+
+    /* passed to the mysql_autocommit function, it should be 0 or 1 */
+    my_bool autocommit_mode;
+
+    /*
+     * the number of connections established by `db_open_config`, it
+     * may be zero
+     */
+    unsigned int min_conns;
+
+    /*
+     * the maximum number of connections in the pool, the connections
+     * above `min_conns` are established on demand by `db_get_conn`
+     *
+     * the pool storage is allocated for this number of connections by
+     * the first successful `db_open_config` call and can not be changed
+     * later
+     */
+    unsigned int max_conns;
+
+    /*
+     * if 1, a thread which returns a connection keeps it aside and gets
+     * the same connection back on its next request without touching the
+     * shared pool state, a thread which finds the pool empty may steal
+     * such a connection, every pool has its own cache, the connections
+     * kept aside are still closed by `idle_timeout_ms` and retired by
+     * `max_lifetime_ms` when the maintenance thread runs
+     *
+     * the default is 0
+     */
+    int thread_cache;
+
+    /*
+     * the number of shards the pool is split into, every shard has its
+     * own free list, a thread takes the connections from the shard of
+     * the CPU it runs on and steals from the neighbouring shards only
+     * when its own shard is empty, the threads which have to wait share
+     * one queue of the pool, ordered by the priority and the time of
+     * arrival
+     *
+     * 0 means one shard per CPU (or NUMA node), the number is capped by
+     * `max_conns`, the default is 0
+     */
+    unsigned int shards;
+
+    /*
+     * if 1, the shard is picked by the NUMA node instead of the CPU
+     *
+     * the CPU and the node are known only on Linux, elsewhere every
+     * thread is given a shard round-robin and this has no effect
+     *
+     * the default is 0
+     */
+    int shard_by_node;
+
+    /*
+     * the maximum number of threads establishing the `min_conns`
+     * connections in parallel, including the thread which calls
+     * `db_open_config`, 1 connects them one by one
+     *
+     * the default is DB_CONNECT_THREADS
+     */
+    unsigned int connect_threads;
+
+    /*
+     * how the `min_conns` connections are established
+     *
+     * DB_WARMUP_EAGER - by `db_open_config`, which fails if any of them
+     *                   fails
+     *
+     * DB_WARMUP_LAZY - by `db_open_config`, but the ones which fail are
+     *                  left to be connected on demand, so the open
+     *                  does not fail because of the server
+     *
+     * DB_WARMUP_BACKGROUND - by a background thread started by
+     *                        `db_open_config`, which returns without
+     *                        waiting for any handshake, the failed
+     *                        attempts are repeated every
+     *                        DB_WARMUP_RETRY_MS milliseconds until the
+     *                        pool is closed
+     *
+     * in every mode the connections above `min_conns` are established
+     * on demand by `db_get_conn` and a request which comes before the
+     * warm-up is done connects a slot on its own
+     *
+     * the default is DB_WARMUP_EAGER
+     */
+    int warmup;
+
+    /*
+     * how long (in milliseconds) a request waits for a connection to be
+     * returned before the pool grows by connecting one more slot, 0
+     * makes the pool grow as soon as all the connections are busy
+     *
+     * the pool always grows at once while fewer than `min_conns` (or
+     * no) connections are established, so a request which comes before
+     * the warm-up is done, or after the idle connections were closed,
+     * does not wait for a return which can not come, `db_try_get_conn`
+     * connects a slot then too, otherwise it fails at once instead of
+     * growing
+     *
+     * the default is 0
+     */
+    unsigned int grow_wait_ms;
+
+    /*
+     * the connections which are not used for longer than this (in
+     * milliseconds) are closed, but never below `min_conns`, 0 keeps
+     * them open forever
+     *
+     * the default is 0
+     */
+    unsigned int idle_timeout_ms;
+
+    /*
+     * the interval (in milliseconds) of the background health check,
+     * a maintenance thread pings the connections which are idle at
+     * least this long and replaces the broken ones, so the borrowers
+     * don't pay for the reconnect after a network failure or after
+     * the server closed an idle connection, the same thread closes the
+     * connections idle longer than `idle_timeout_ms`, 0 disables it
+     *
+     * the default is 0
+     */
+    unsigned int health_interval_ms;
+
+    /*
+     * a connection which is idle longer than this (in milliseconds) is
+     * pinged before it is handed out and reconnected if the ping fails,
+     * the recently used ones are handed out without a check, 0 disables
+     * the check
+     *
+     * the default is 0
+     */
+    unsigned int validate_idle_ms;
+
+    /*
+     * the maximum lifetime of a connection (in milliseconds), an older
+     * connection is replaced when it is returned to the pool or by the
+     * maintenance thread of `health_interval_ms` while it is idle,
+     * never when it is borrowed, the lifetime of each connection is
+     * shortened by a random amount of up to a quarter, so the
+     * connections opened together are not replaced all at once, 0
+     * keeps them forever
+     *
+     * the default is 0
+     */
+    unsigned int max_lifetime_ms;
+
+    /*
+     * 1 to set up the connections for the non-blocking `db_async_*`
+     * functions, it needs the MariaDB Connector/C library, see
+     * DB_ASYNC, the blocking calls keep working on such connections
+     *
+     * the default is 0
+     */
+    int nonblock;
+
+    /*
+     * the number of prepared statements `db_prepare_cached` keeps per
+     * connection, the least recently used one is closed to make room
+     * for a new one, 0 disables the cache
+     *
+     * the default is DB_STMT_CACHE_SIZE
+     */
+    unsigned int stmt_cache_size;
+
+    /*
+     * 1 to prepare all the queries registered with `db_register_query`
+     * as soon as a connection is established, so the first
+     * `db_handle_stmt` calls find them ready, this happens in the
+     * threads which connect, which is in the background with the
+     * DB_WARMUP_BACKGROUND mode, a failure is not fatal, the query is
+     * prepared again on its first use
+     *
+     * the default is 0
+     */
+    int prepare_queries;
+
+    /*
+     * when `db_stream_query` stops before the end of the result set, it
+     * reads and discards up to this number of the remaining rows, if
+     * the result set does not end by then, the connection is closed and
+     * replaced when it is returned, which is faster than reading a
+     * large result set to its end, 0 always replaces the connection
+     *
+     * the default is DB_STREAM_DRAIN_ROWS
+     */
+    unsigned int stream_drain_rows;
+
+    /*
+     * the size of the memory block of the per-borrow arena, see
+     * `db_handle_alloc`, the first block is allocated on the first use
+     * and kept with the connection, the blocks added when it is full
+     * are freed when the connection is returned, 0 allocates a block
+     * for every allocation
+     *
+     * the default is DB_ARENA_SIZE
+     */
+    size_t arena_size;
+
+    /*
+     * the number of connections only the DB_PRIO_INTERACTIVE borrowers
+     * may take, they are used when all the other connections are busy,
+     * it must be less than `max_conns`
+     *
+     * the reserved connections are the first ones established at open
+     * time (or on demand) and they are never closed as idle
+     *
+     * the default is 0
+     */
+    unsigned int reserved_conns;
+
+    /*
+     * the read-your-writes window (in milliseconds), a thread which
+     * returned a DB_WRITE connection reads from the primary instead of
+     * the replicas for this long, 0 disables it
+     *
+     * the default is 0
+     */
+    unsigned int rw_window_ms;
+};
+
+/*
+ * fill `config` with the default values, the pool will contain
+ * DB_POOL_CONN_COUNT connections all established at open time
+ */
+void db_config_init(struct db_config *config);
+
+/*
+ * open database connections and fill the pool with them using the
+ * settings from `config`
+ *
+ * returns zero on success or a negative value on error
+ */
+int db_open_config(const struct db_config *config);
+
 /*
  * close all the database connections in the pool
  *
@@ -90,17 +425,251 @@ int db_is_open(void);
 int db_is_closed(void);
 
 /*
- * get a `MYSQL` connection from the pool
+ * get a `MYSQL` connection from the pool, with the DB_PRIO_INTERACTIVE
+ * priority
  */
 MYSQL *db_get_conn(void);
 
+/*
+ * get a `MYSQL` connection from the pool, waiting at most `timeout_ns`
+ * nanoseconds for one to become available
+ *
+ * the timeout covers the whole acquire and is measured on the
+ * CLOCK_MONOTONIC clock, so it is not affected by changes of the
+ * system time, the handshake of a connection established on demand is
+ * limited by the connect timeout of the client library instead
+ *
+ * returns NULL on error or when the timeout expires
+ */
+MYSQL *db_get_conn_timed(uint64_t timeout_ns);
+
+/*
+ * get a `MYSQL` connection from the pool without waiting for another
+ * thread to return one
+ *
+ * it still does the work a borrower does on its own thread, so it can
+ * block for a handshake when it connects an empty slot (see
+ * `grow_wait_ms`) or for a ping when the connection is older than
+ * `validate_idle_ms`, both are limited by the timeouts of the client
+ * library
+ *
+ * returns NULL on error or when no connection is available right now
+ */
+MYSQL *db_try_get_conn(void);
+
+/*
+ * get a `MYSQL` connection from the pool for a borrower of the
+ * `priority` priority, one of the DB_PRIO_ values, waiting at most
+ * `timeout_ns` nanoseconds, 0 does not wait at all and DB_WAIT_FOREVER
+ * waits without a timeout
+ *
+ * the waiting borrowers are served strictly by the priority and by the
+ * time of arrival within the same priority, and only the
+ * DB_PRIO_INTERACTIVE ones may take the `reserved_conns` connections
+ *
+ * `db_get_conn`, `db_get_conn_timed` and `db_try_get_conn` borrow with
+ * the DB_PRIO_INTERACTIVE priority
+ *
+ * returns NULL on error or when the timeout expires
+ */
+MYSQL *db_get_conn_prio(int priority, uint64_t timeout_ns);
+
 /*
  * return a `MYSQL` connection to the pool
  *
+ * the slot of the connection has to be looked up, please prefer
+ * `db_get_handle` and `db_post_handle` on hot paths
+ *
  * returns zero on success or a negative value on error
  */
 int db_post_conn(MYSQL *mysql_conn);
 
+/*
+ * get a connection handle from the pool
+ *
+ * the handle identifies the pool slot of the connection, so returning
+ * it with `db_post_handle` does not need any searching
+ *
+ * returns NULL on error
+ */
+db_handle_t *db_get_handle(void);
+
+/*
+ * get a connection handle from the pool, waiting at most `timeout_ns`
+ * nanoseconds, see `db_get_conn_timed`
+ *
+ * returns NULL on error or when the timeout expires
+ */
+db_handle_t *db_get_handle_timed(uint64_t timeout_ns);
+
+/*
+ * get a connection handle from the pool without waiting, see
+ * `db_try_get_conn`
+ *
+ * returns NULL on error or when no connection is available right now
+ */
+db_handle_t *db_try_get_handle(void);
+
+/*
+ * get a connection handle from the pool for a borrower of the
+ * `priority` priority, see `db_get_conn_prio`
+ *
+ * returns NULL on error or when the timeout expires
+ */
+db_handle_t *db_get_handle_prio(int priority, uint64_t timeout_ns);
+
+/*
+ * return a connection handle to the pool, the handle must not be used
+ * after this call
+ *
+ * returns zero on success or a negative value on error
+ */
+int db_post_handle(db_handle_t *handle);
+
+/*
+ * get the `MYSQL` connection of a borrowed handle
+ */
+MYSQL *db_handle_conn(const db_handle_t *handle);
+
+/*
+ * get the pool slot index of a borrowed handle, it is in the range
+ * from 0 to `max_conns` - 1 and can be used to keep per-connection data
+ * in a plain array
+ */
+unsigned int db_handle_slot(const db_handle_t *handle);
+
+/*
+ * get the generation of a borrowed handle, the slot generation is
+ * incremented on every borrow, so a (slot, generation) pair identifies
+ * a single borrow
+ */
+uint64_t db_handle_generation(const db_handle_t *handle);
+
+/*
+ * get the time when the handle was borrowed, in nanoseconds of
+ * CLOCK_MONOTONIC
+ */
+uint64_t db_handle_acquired(const db_handle_t *handle);
+
+/*
+ * get the pool a borrowed handle belongs to
+ */
+db_pool_t *db_handle_pool(const db_handle_t *handle);
+
+/*
+ * create a new pool with the settings from `config` and open it like
+ * `db_open_config` does for the default pool
+ *
+ * `name` may be NULL, otherwise it must be unique, the pool can be
+ * looked up by it using `db_pool_find`
+ *
+ * returns NULL on error
+ */
+db_pool_t *db_pool_create(const char *name, const struct db_config *config);
+
+/*
+ * close a pool created by `db_pool_create`, waiting until all its
+ * connections are returned, then close the connections and free the
+ * pool, the default pool can not be destroyed, if the closing fails
+ * the pool stays registered and can be destroyed again later
+ *
+ * returns zero on success or a negative value on error
+ */
+int db_pool_destroy(db_pool_t *pool);
+
+/*
+ * find a pool by the name given to `db_pool_create`
+ *
+ * returns NULL if there is no such pool
+ */
+db_pool_t *db_pool_find(const char *name);
+
+/*
+ * get the default pool, the one used by the `db_` functions without a
+ * pool argument
+ *
+ * returns NULL if `db_open_config` did not succeed yet
+ */
+db_pool_t *db_pool_default(void);
+
+/*
+ * get the name of a pool, NULL for an unnamed one
+ */
+const char *db_pool_name(const db_pool_t *pool);
+
+/*
+ * these work like the `db_` functions of the same names, but on `pool`
+ * instead of the default pool
+ *
+ * `db_pool_open` reopens a pool closed by `db_pool_close`, the
+ * handles are returned by `db_post_handle` to the pool they belong to
+ */
+int db_pool_open(db_pool_t *pool);
+int db_pool_close(db_pool_t *pool);
+int db_pool_is_open(db_pool_t *pool);
+int db_pool_is_closed(db_pool_t *pool);
+MYSQL *db_pool_get_conn(db_pool_t *pool);
+MYSQL *db_pool_get_conn_timed(db_pool_t *pool, uint64_t timeout_ns);
+MYSQL *db_pool_try_get_conn(db_pool_t *pool);
+MYSQL *db_pool_get_conn_prio(db_pool_t *pool, int priority,
+        uint64_t timeout_ns);
+int db_pool_post_conn(db_pool_t *pool, MYSQL *mysql_conn);
+db_handle_t *db_pool_get_handle(db_pool_t *pool);
+db_handle_t *db_pool_get_handle_timed(db_pool_t *pool, uint64_t timeout_ns);
+db_handle_t *db_pool_try_get_handle(db_pool_t *pool);
+db_handle_t *db_pool_get_handle_prio(db_pool_t *pool, int priority,
+        uint64_t timeout_ns);
+
+/*
+ * add `replica` to the replicas of `pool`, the DB_READ borrowers of
+ * `pool` get the connections of its replicas
+ *
+ * the load of a replica is measured from the time of every borrow
+ * and return, it is the number of the borrowed connections times the
+ * moving average of the time they are borrowed for
+ *
+ * a pool can be a replica of a single pool, a pool with replicas can
+ * not be a replica itself, and a replica can not be destroyed
+ *
+ * returns zero on success or a negative value on error
+ */
+int db_pool_add_replica(db_pool_t *pool, db_pool_t *replica);
+
+/*
+ * get a `MYSQL` connection from the default pool for DB_READ or
+ * DB_WRITE
+ *
+ * the writes use the pool itself (the primary), the reads use a free
+ * connection of the least loaded replica which has one, or wait on the
+ * least loaded replica, and they fall back to the primary if the
+ * replica is closed or can not connect, or if the same thread returned
+ * a DB_WRITE connection less than `rw_window_ms` milliseconds ago
+ *
+ * the connection is returned by `db_post_conn` as usual
+ *
+ * returns NULL on error
+ */
+MYSQL *db_get_conn_for(int mode);
+
+/*
+ * get a connection handle from the default pool for DB_READ or
+ * DB_WRITE, see `db_get_conn_for`
+ *
+ * returns NULL on error
+ */
+db_handle_t *db_get_handle_for(int mode);
+
+/*
+ * these work like `db_get_conn_for` and `db_get_handle_for`, but on
+ * `pool`, the handle variant takes the priority and the timeout of
+ * `db_get_conn_prio` too, the timeout covers the fallback to the
+ * primary, with the timeout 0 a read fails instead of falling back
+ * when a replica is usable but has no free connection at the moment
+ */
+MYSQL *db_pool_get_conn_for(db_pool_t *pool, int mode);
+db_handle_t *db_pool_get_handle_for(db_pool_t *pool, int mode,
+        int priority, uint64_t timeout_ns);
+
 /*
  * ping `MYSQL` connection, it can help to reconnect a lost connection
  *
@@ -108,6 +677,388 @@ int db_post_conn(MYSQL *mysql_conn);
  */
 int db_ping(MYSQL *mysql_conn);
 
+/*
+ * get a prepared statement for `sql` on a connection borrowed from the
+ * default pool, it is prepared on the first use and then taken from
+ * the cache of the connection
+ *
+ * the statement belongs to the cache, it must not be closed, and it
+ * must be done with (its result fetched or freed) before the next
+ * `db_prepare_cached` call on the connection or before the connection
+ * is returned, when the connection reconnects its cache is emptied,
+ * so a statement must not be kept after a `db_ping` call either
+ *
+ * returns NULL on error, the error of the server can be read with
+ * `mysql_error(mysql_conn)` then
+ */
+MYSQL_STMT *db_prepare_cached(MYSQL *mysql_conn, const char *sql);
+
+/*
+ * get a prepared statement for `sql` on a connection borrowed from
+ * `pool`, see `db_prepare_cached`
+ *
+ * returns NULL on error
+ */
+MYSQL_STMT *db_pool_prepare_cached(db_pool_t *pool, MYSQL *mysql_conn,
+        const char *sql);
+
+/*
+ * get a prepared statement for the `length` bytes of `sql` on a
+ * borrowed handle, see `db_prepare_cached`, it does not need to look
+ * the slot up
+ *
+ * returns NULL on error
+ */
+MYSQL_STMT *db_handle_prepare(db_handle_t *handle, const char *sql,
+        unsigned long length);
+
+/*
+ * register a hot query, usually at startup, the ids are dense and start
+ * from 0, so every connection keeps its prepared statements in a plain
+ * array and `db_handle_stmt` does no hashing and no string comparison,
+ * registering the same query again returns the same id, there can be
+ * up to DB_QUERIES_MAX queries and they stay registered for the life of
+ * the process
+ *
+ *   static int q_user;
+ *
+ *   q_user = db_register_query("SELECT name FROM users WHERE id = ?");
+ *   ...
+ *   stmt = db_handle_stmt(handle, q_user);
+ *
+ * returns the id of the query or a negative value on error
+ */
+int db_register_query(const char *sql);
+
+/*
+ * get the prepared statement of the registered query `id` on a borrowed
+ * handle, the same rules apply to it as to the `db_prepare_cached`
+ * statements, but it does not count against `stmt_cache_size`
+ *
+ * returns NULL on error
+ */
+MYSQL_STMT *db_handle_stmt(db_handle_t *handle, int id);
+
+/*
+ * get the prepared statement of the registered query `id` on a
+ * connection borrowed from the default pool or from `pool`, the slot of
+ * the connection has to be looked up, see `db_post_conn`
+ *
+ * returns NULL on error
+ */
+MYSQL_STMT *db_stmt(MYSQL *mysql_conn, int id);
+MYSQL_STMT *db_pool_stmt(db_pool_t *pool, MYSQL *mysql_conn, int id);
+
+/*
+ * fetch up to `max_rows` rows of the executed `stmt` in the binary
+ * protocol straight into an array of rows owned by the caller, without
+ * converting the values to text and back
+ *
+ * `bind` has one element for every column of the result and describes
+ * the first row like for `mysql_stmt_bind_result`, the `buffer`,
+ * `length`, `is_null` and `error` pointers of the row `n` are those of
+ * the first row moved by `n * row_size` bytes, so with
+ *
+ *   struct user { long long id; char name[64]; unsigned long name_len; };
+ *   struct user users[100];
+ *
+ * the `bind` elements point to the fields of `users[0]` and `row_size`
+ * is `sizeof(struct user)`, the columns can also be separate arrays if
+ * their elements have the same size, the `bind` array is left as it was
+ * given and `stmt` is left bound to it
+ *
+ * a truncated value does not stop the fetching, it can be noticed with
+ * the `error` pointers
+ *
+ * returns the number of the fetched rows, which is 0 when there are no
+ * more rows, or a negative value on error, the error of the server can
+ * be read with `mysql_stmt_error(stmt)` then
+ */
+long db_stmt_fetch_rows(MYSQL_STMT *stmt, MYSQL_BIND *bind, size_t row_size,
+        unsigned long max_rows);
+
+/*
+ * the callback of `db_stream_query`, it gets `rows` rows of `fields`
+ * fields, the value of the field `f` of the row `r` is
+ * `values[r * fields + f]`, NULL for the SQL NULL, and its length is
+ * `lengths[r * fields + f]`, the values are NUL-terminated and they are
+ * valid only until the callback returns
+ *
+ * returns zero to continue or a non-zero value to stop
+ */
+typedef int (*db_rows_cb)(char **values, const unsigned long *lengths,
+        unsigned long rows, unsigned int fields, void *arg);
+
+/*
+ * run `query` on a connection borrowed from the default pool and pass
+ * its result set to `cb` in batches of up to `batch_rows` rows, the
+ * rows are read with `mysql_use_result`, so the memory used depends on
+ * `batch_rows` and not on the size of the result set
+ *
+ * the connection can be returned to the pool even if the callback
+ * stopped or an error happened in the middle, see `stream_drain_rows`
+ *
+ * returns zero when all the rows were passed, 1 when the callback
+ * stopped or a negative value on error, the error of the server can be
+ * read with `mysql_error(mysql_conn)` then
+ */
+int db_stream_query(MYSQL *mysql_conn, const char *query,
+        unsigned int batch_rows, db_rows_cb cb, void *arg);
+
+/*
+ * these work like `db_stream_query`, but on a connection borrowed from
+ * `pool` or on a borrowed handle, the handle variant takes the length
+ * of `query` and does not need to look the slot up
+ */
+int db_pool_stream_query(db_pool_t *pool, MYSQL *mysql_conn,
+        const char *query, unsigned int batch_rows, db_rows_cb cb,
+        void *arg);
+int db_handle_stream(db_handle_t *handle, const char *query,
+        unsigned long length, unsigned int batch_rows, db_rows_cb cb,
+        void *arg);
+
+/*
+ * allocate `size` bytes from the arena of a borrowed handle, the memory
+ * is suitably aligned for any type, it is not freed one by one, all of
+ * it is released at once when the handle is returned to the pool, so it
+ * must not be used after that
+ *
+ * returns NULL on error
+ */
+void *db_handle_alloc(db_handle_t *handle, size_t size);
+
+/*
+ * escape the `length` bytes of `from` with `mysql_real_escape_string`
+ * into the arena of `handle`, see `db_handle_alloc`, the length of the
+ * escaped string is stored to `escaped_length` if it is not NULL
+ *
+ * returns the NUL-terminated escaped string or NULL on error
+ */
+char *db_handle_escape(db_handle_t *handle, const char *from,
+        unsigned long length, unsigned long *escaped_length);
+
+/*
+ * format a string, usually the text of a query, like `snprintf` into
+ * the arena of `handle`, see `db_handle_alloc`
+ *
+ * returns the string or NULL on error
+ */
+char *db_handle_printf(db_handle_t *handle, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/*
+ * copy the row `row` of `fields` fields with the `lengths` lengths, as
+ * returned by `mysql_fetch_row` and `mysql_fetch_lengths`, into the
+ * arena of `handle`, see `db_handle_alloc`, so it stays valid after the
+ * next fetch and after the result set is freed, the copied values are
+ * NUL-terminated
+ *
+ * returns the copy or NULL on error
+ */
+MYSQL_ROW db_handle_copy_row(db_handle_t *handle, MYSQL_ROW row,
+        const unsigned long *lengths, unsigned int fields);
+
+/*
+ * the non-blocking API, it is available when the client library is the
+ * MariaDB Connector/C, which provides the `mysql_*_start` and
+ * `mysql_*_cont` functions, and it works only on the connections of
+ * the pools with the `nonblock` configuration option set
+ *
+ * an operation is started on a borrowed handle, the start and the
+ * continue functions return a positive value while the operation waits
+ * for the events in that value, zero when it has completed
+ * successfully or a negative value on error, a single event loop
+ * thread can drive many connections this way:
+ *
+ *   - wait until the socket `db_async_fd` becomes readable or writable
+ *     as requested by DB_ASYNC_READ, DB_ASYNC_WRITE and
+ *     DB_ASYNC_EXCEPT, or for `db_async_timeout_ms` milliseconds if
+ *     DB_ASYNC_TIMEOUT is requested
+ *   - call `db_async_cont` with the events which have happened
+ *
+ * only one operation can run on a handle at a time, a handle which is
+ * returned to the pool with an unfinished operation gets a new
+ * connection, as the state of the old one is unknown
+ *
+ * the borrowing itself does not wait when `db_pool_try_get_handle` is
+ * used, except for connecting an empty slot
+ */
+#if defined(MYSQL_WAIT_READ)
+
+#define DB_ASYNC                  (1)
+
+#define DB_ASYNC_READ             MYSQL_WAIT_READ
+#define DB_ASYNC_WRITE            MYSQL_WAIT_WRITE
+#define DB_ASYNC_EXCEPT           MYSQL_WAIT_EXCEPT
+#define DB_ASYNC_TIMEOUT          MYSQL_WAIT_TIMEOUT
+
+/*
+ * start the `query` of `length` bytes on `handle`, when it completes,
+ * its result set, if any, is stored and can be taken with
+ * `db_async_result`
+ *
+ * returns the events to wait for, zero on completion or a negative
+ * value on error, the error of the server can be read with
+ * `mysql_error(db_handle_conn(handle))`
+ */
+int db_async_query(db_handle_t *handle, const char *query,
+        unsigned long length);
+
+/*
+ * start pinging the connection of `handle`
+ *
+ * returns the events to wait for, zero on completion or a negative
+ * value on error
+ */
+int db_async_ping(db_handle_t *handle);
+
+/*
+ * continue the operation running on `handle` after some of the
+ * requested `events` have happened
+ *
+ * returns the events to wait for, zero on completion or a negative
+ * value on error
+ */
+int db_async_cont(db_handle_t *handle, int events);
+
+/*
+ * get the socket to wait on for the operation running on `handle`
+ *
+ * returns a negative value on error
+ */
+int db_async_fd(const db_handle_t *handle);
+
+/*
+ * get how long (in milliseconds) to wait at most when DB_ASYNC_TIMEOUT
+ * is requested
+ */
+unsigned int db_async_timeout_ms(const db_handle_t *handle);
+
+/*
+ * take the result set of the last completed `db_async_query` on
+ * `handle`, it must be freed with `mysql_free_result`
+ *
+ * returns NULL if the query did not return a result set
+ */
+MYSQL_RES *db_async_result(db_handle_t *handle);
+
+/*
+ * the reactor, an epoll based event loop which drives the non-blocking
+ * operations of many handles and the waiting for the connections from
+ * one thread, it is available on Linux
+ *
+ * the operations are started by the `db_reactor_acquire`,
+ * `db_reactor_query` and `db_reactor_ping` functions and their
+ * callbacks are called from `db_reactor_run`, never from the function
+ * which started the operation
+ *
+ * a reactor is not thread-safe, all its functions must be called from
+ * the thread which runs it, the callbacks run in that thread too, but
+ * the connections it waits for can be returned by any thread
+ */
+#if defined(__linux__)
+
+#define DB_REACTOR                (1)
+
+/*
+ * the maximum number of the socket events handled by one
+ * `db_reactor_run` call
+ */
+#define DB_REACTOR_EVENTS         (64)
+
+typedef struct db_reactor db_reactor_t;
+
+/*
+ * called when a connection is borrowed, `handle` is NULL on error or
+ * on timeout, `db_error` tells which
+ */
+typedef void (*db_acquire_cb)(db_handle_t *handle, void *arg);
+
+/*
+ * called when a query or a ping on `handle` completes, `result` is
+ * zero on success or a negative value on error
+ */
+typedef void (*db_done_cb)(db_handle_t *handle, int result, void *arg);
+
+/*
+ * create a reactor
+ *
+ * returns NULL on error
+ */
+db_reactor_t *db_reactor_create(void);
+
+/*
+ * destroy `reactor`, it must not have any pending operations
+ *
+ * returns zero on success or a negative value on error
+ */
+int db_reactor_destroy(db_reactor_t *reactor);
+
+/*
+ * get the epoll descriptor of `reactor`, it becomes readable when
+ * `db_reactor_run` has work to do, so the reactor can be nested into
+ * another event loop
+ */
+int db_reactor_fd(const db_reactor_t *reactor);
+
+/*
+ * get the number of the operations of `reactor` which did not call
+ * their callbacks yet
+ */
+unsigned int db_reactor_pending(const db_reactor_t *reactor);
+
+/*
+ * wait for the events for `timeout_ms` milliseconds at most (-1 waits
+ * until something happens, 0 does not wait) and call the callbacks of
+ * the completed operations
+ *
+ * returns the number of the called callbacks or a negative value on
+ * error
+ */
+int db_reactor_run(db_reactor_t *reactor, int timeout_ms);
+
+/*
+ * borrow a connection from `pool` and pass it to `callback`, when all
+ * of them are busy the reactor joins the wait queue of the pool with
+ * `priority` for `timeout_ns` nanoseconds at most, it is 0 for not
+ * waiting or DB_WAIT_FOREVER, the connection is returned with
+ * `db_post_handle` as usual
+ *
+ * the callback is called from `db_reactor_run` also when the pool is
+ * busy and `timeout_ns` is 0, with NULL and the busy error
+ *
+ * an empty slot is still connected with the blocking calls, and the
+ * pool must not be destroyed while the reactor waits for it
+ *
+ * returns zero on success or a negative value on error
+ */
+int db_reactor_acquire(db_reactor_t *reactor, db_pool_t *pool,
+        int priority, uint64_t timeout_ns, db_acquire_cb callback,
+        void *arg);
+
+/*
+ * run `db_async_query` on `handle` and call `callback` when it
+ * completes, the result set is taken with `db_async_result`
+ *
+ * returns zero on success or a negative value on error
+ */
+int db_reactor_query(db_reactor_t *reactor, db_handle_t *handle,
+        const char *query, unsigned long length, db_done_cb callback,
+        void *arg);
+
+/*
+ * run `db_async_ping` on `handle` and call `callback` when it
+ * completes
+ *
+ * returns zero on success or a negative value on error
+ */
+int db_reactor_ping(db_reactor_t *reactor, db_handle_t *handle,
+        db_done_cb callback, void *arg);
+
+#endif /* __linux__ */
+
+#endif /* MYSQL_WAIT_READ */
+
 #if defined(__cplusplus)
 }
 #endif
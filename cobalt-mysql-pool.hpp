@@ -0,0 +1,416 @@
+/*
+ * cobalt-mysql-pool
+ *
+ * A header-only C++20 coroutine front-end for the reactor of the
+ * cobalt-mysql-pool module, borrowing a connection and running a query
+ * are awaitables which resume when the non-blocking operation
+ * completes:
+ *
+ *   cobalt::task work(cobalt::pool &pool)
+ *   {
+ *       cobalt::connection conn = co_await pool.acquire();
+ *       cobalt::result res = co_await conn.query("SELECT 1");
+ *       ...
+ *   }   // the connection goes back to the pool here
+ *
+ * the coroutines are resumed from `cobalt::reactor::run`, so they run
+ * in the thread which runs the reactor, the errors are thrown as
+ * `cobalt::error`
+ *
+ * https://github.com/0xebef/cobalt-mysql-pool
+ *
+ * License: LGPLv3 or later
+ *
+ * Copyright (c) 2026, 0xebef
+ */
+
+#ifndef COBALT_MYSQL_POOL_HPP_INCLUDED
+#define COBALT_MYSQL_POOL_HPP_INCLUDED
+
+#include "cobalt-mysql-pool.h"
+
+#if defined(DB_REACTOR) && __cplusplus >= 202002L
+
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace cobalt {
+
+/*
+ * thrown when an operation fails, the message is the one of `db_error`
+ * or of the server
+ */
+class error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/*
+ * the result set of a query, it is freed when it goes out of scope, it
+ * is empty for the statements without a result set
+ */
+struct result_deleter {
+    void operator()(MYSQL_RES *res) const noexcept
+    {
+        mysql_free_result(res);
+    }
+};
+
+using result = std::unique_ptr<MYSQL_RES, result_deleter>;
+
+/*
+ * an owning wrapper of `db_reactor_t`
+ */
+class reactor {
+public:
+    reactor() : reactor_(db_reactor_create())
+    {
+        if (!reactor_) {
+            throw error(db_error());
+        }
+    }
+
+    reactor(const reactor &) = delete;
+    reactor &operator=(const reactor &) = delete;
+
+    /* the pending operations must have completed */
+    ~reactor()
+    {
+        db_reactor_destroy(reactor_);
+    }
+
+    /*
+     * resume the coroutines whose operations have completed, waiting
+     * for `timeout_ms` milliseconds at most, see `db_reactor_run`
+     *
+     * returns the number of the resumed operations
+     */
+    int run(int timeout_ms = -1)
+    {
+        const int count = db_reactor_run(reactor_, timeout_ms);
+
+        if (count < 0) {
+            throw error(db_error());
+        }
+
+        return count;
+    }
+
+    /*
+     * run until no operation is pending
+     */
+    void run_all()
+    {
+        while (pending()) {
+            run();
+        }
+    }
+
+    unsigned int pending() const noexcept
+    {
+        return db_reactor_pending(reactor_);
+    }
+
+    int fd() const noexcept
+    {
+        return db_reactor_fd(reactor_);
+    }
+
+    db_reactor_t *native() const noexcept
+    {
+        return reactor_;
+    }
+
+private:
+    db_reactor_t *reactor_;
+};
+
+/*
+ * the awaitable of `connection::query` and `connection::ping`
+ */
+class query_awaiter {
+public:
+    query_awaiter(db_reactor_t *reactor, db_handle_t *handle,
+            std::string_view query, bool ping) noexcept
+        : reactor_(reactor), handle_(handle), query_(query), ping_(ping)
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    /* doesn't suspend if the operation can't be started */
+    bool await_suspend(std::coroutine_handle<> coroutine)
+    {
+        int started;
+
+        coroutine_ = coroutine;
+
+        if (ping_) {
+            started = db_reactor_ping(reactor_, handle_, &done, this);
+        } else {
+            started = db_reactor_query(reactor_, handle_, query_.data(),
+                    query_.size(), &done, this);
+        }
+
+        if (started != 0) {
+            message_ = db_error();
+            return false;
+        }
+
+        return true;
+    }
+
+    result await_resume()
+    {
+        if (!message_.empty()) {
+            throw error(message_);
+        }
+
+        return result(db_async_result(handle_));
+    }
+
+private:
+    static void done(db_handle_t *handle, int status, void *arg)
+    {
+        query_awaiter *self = static_cast<query_awaiter *>(arg);
+
+        if (status != 0) {
+            /* the message of the server is more useful */
+            const char *message = mysql_error(db_handle_conn(handle));
+
+            self->message_ = message && *message ? message : db_error();
+        }
+
+        self->coroutine_.resume();
+    }
+
+    db_reactor_t *reactor_;
+    db_handle_t *handle_;
+    std::string_view query_;
+    bool ping_;
+    std::coroutine_handle<> coroutine_;
+    std::string message_;
+};
+
+/*
+ * a borrowed connection, it is returned to its pool when it goes out of
+ * scope, it can be moved, but not copied
+ */
+class connection {
+public:
+    connection() noexcept = default;
+
+    connection(db_reactor_t *reactor, db_handle_t *handle) noexcept
+        : reactor_(reactor), handle_(handle)
+    {
+    }
+
+    connection(connection &&other) noexcept
+        : reactor_(other.reactor_),
+          handle_(std::exchange(other.handle_, nullptr))
+    {
+    }
+
+    connection &operator=(connection &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            reactor_ = other.reactor_;
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+
+        return *this;
+    }
+
+    connection(const connection &) = delete;
+    connection &operator=(const connection &) = delete;
+
+    ~connection()
+    {
+        reset();
+    }
+
+    /*
+     * return the connection to the pool now
+     */
+    void reset() noexcept
+    {
+        if (handle_) {
+            db_post_handle(std::exchange(handle_, nullptr));
+        }
+    }
+
+    /*
+     * run `query` without blocking, the string must stay valid until
+     * the query completes
+     */
+    query_awaiter query(std::string_view query) const noexcept
+    {
+        return query_awaiter(reactor_, handle_, query, false);
+    }
+
+    query_awaiter ping() const noexcept
+    {
+        return query_awaiter(reactor_, handle_, std::string_view(), true);
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return handle_ != nullptr;
+    }
+
+    MYSQL *get() const noexcept
+    {
+        return handle_ ? db_handle_conn(handle_) : nullptr;
+    }
+
+    db_handle_t *native() const noexcept
+    {
+        return handle_;
+    }
+
+private:
+    db_reactor_t *reactor_ = nullptr;
+    db_handle_t *handle_ = nullptr;
+};
+
+/*
+ * the awaitable of `pool::acquire`
+ */
+class acquire_awaiter {
+public:
+    acquire_awaiter(db_reactor_t *reactor, db_pool_t *pool, int priority,
+            std::uint64_t timeout_ns) noexcept
+        : reactor_(reactor), pool_(pool), priority_(priority),
+          timeout_ns_(timeout_ns)
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    /* doesn't suspend if the borrowing can't be started */
+    bool await_suspend(std::coroutine_handle<> coroutine)
+    {
+        coroutine_ = coroutine;
+
+        if (db_reactor_acquire(reactor_, pool_, priority_, timeout_ns_,
+                    &done, this) != 0) {
+            message_ = db_error();
+            return false;
+        }
+
+        return true;
+    }
+
+    connection await_resume()
+    {
+        if (!handle_) {
+            throw error(message_);
+        }
+
+        return connection(reactor_, handle_);
+    }
+
+private:
+    static void done(db_handle_t *handle, void *arg)
+    {
+        acquire_awaiter *self = static_cast<acquire_awaiter *>(arg);
+
+        self->handle_ = handle;
+        if (!handle) {
+            self->message_ = db_error();
+        }
+
+        self->coroutine_.resume();
+    }
+
+    db_reactor_t *reactor_;
+    db_pool_t *pool_;
+    int priority_;
+    std::uint64_t timeout_ns_;
+    std::coroutine_handle<> coroutine_;
+    db_handle_t *handle_ = nullptr;
+    std::string message_;
+};
+
+/*
+ * a pool used through a reactor, it does not own either of them
+ */
+class pool {
+public:
+    pool(reactor &owner, db_pool_t *native_pool) noexcept
+        : reactor_(owner.native()), pool_(native_pool)
+    {
+    }
+
+    /*
+     * borrow a connection, waiting in the queue of the pool with
+     * `priority` for `timeout_ns` nanoseconds at most, see
+     * `db_reactor_acquire`
+     */
+    acquire_awaiter acquire(int priority = DB_PRIO_INTERACTIVE,
+            std::uint64_t timeout_ns = DB_WAIT_FOREVER) const noexcept
+    {
+        return acquire_awaiter(reactor_, pool_, priority, timeout_ns);
+    }
+
+    db_pool_t *native() const noexcept
+    {
+        return pool_;
+    }
+
+private:
+    db_reactor_t *reactor_;
+    db_pool_t *pool_;
+};
+
+/*
+ * a minimal fire-and-forget coroutine type, it starts at once and
+ * frees itself when it completes, an exception which escapes it
+ * terminates the program
+ */
+struct task {
+    struct promise_type {
+        task get_return_object() const noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() const noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() const noexcept
+        {
+            return {};
+        }
+
+        void return_void() const noexcept
+        {
+        }
+
+        void unhandled_exception() const noexcept
+        {
+            std::terminate();
+        }
+    };
+};
+
+} // namespace cobalt
+
+#endif /* DB_REACTOR && C++20 */
+
+#endif /* COBALT_MYSQL_POOL_HPP_INCLUDED */
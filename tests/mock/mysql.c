@@ -0,0 +1,270 @@
+/*
+ * cobalt-mysql-pool tests
+ *
+ * A mock of the parts of the MySQL client library which the pool uses,
+ * see mysql.h.
+ *
+ * https://github.com/0xebef/cobalt-mysql-pool
+ *
+ * License: LGPLv3 or later
+ *
+ * Copyright (c) 2026, 0xebef
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "mysql.h"
+
+struct st_mysql {
+    unsigned long thread_id;
+};
+
+struct st_mysql_res {
+    unsigned long lengths[1];
+};
+
+struct st_mysql_stmt {
+    MYSQL *mysql;
+};
+
+struct mock_stats mock_stats;
+
+/* the server thread ids, every connection gets a new one */
+static atomic_ulong thread_id_next = 1U;
+
+int mysql_library_init(int argc, char **argv, char **groups)
+{
+    (void)argc;
+    (void)argv;
+    (void)groups;
+
+    return 0;
+}
+
+unsigned int mysql_thread_safe(void)
+{
+    return 1U;
+}
+
+my_bool mysql_thread_init(void)
+{
+    return 0;
+}
+
+void mysql_thread_end(void)
+{
+}
+
+MYSQL *mysql_init(MYSQL *mysql)
+{
+    if (mysql) {
+        return NULL;
+    }
+
+    mysql = calloc(1U, sizeof(*mysql));
+    if (mysql) {
+        atomic_fetch_add(&mock_stats.live, 1);
+    }
+
+    return mysql;
+}
+
+int mysql_options(MYSQL *mysql, enum mysql_option option, const void *arg)
+{
+    (void)mysql;
+    (void)option;
+    (void)arg;
+
+    return 0;
+}
+
+MYSQL *mysql_real_connect(MYSQL *mysql, const char *host, const char *user,
+        const char *passwd, const char *db, unsigned int port,
+        const char *unix_socket, unsigned long flags)
+{
+    int fail;
+
+    (void)host;
+    (void)user;
+    (void)passwd;
+    (void)db;
+    (void)port;
+    (void)unix_socket;
+    (void)flags;
+
+    fail = atomic_load(&mock_stats.connect_fail);
+    while (fail > 0) {
+        if (atomic_compare_exchange_weak(&mock_stats.connect_fail, &fail,
+                    fail - 1)) {
+            return NULL;
+        }
+    }
+
+    mysql->thread_id = atomic_fetch_add(&thread_id_next, 1U);
+    atomic_fetch_add(&mock_stats.connects, 1);
+
+    return mysql;
+}
+
+my_bool mysql_autocommit(MYSQL *mysql, my_bool mode)
+{
+    (void)mysql;
+    (void)mode;
+
+    return 0;
+}
+
+void mysql_close(MYSQL *mysql)
+{
+    if (mysql) {
+        atomic_fetch_sub(&mock_stats.live, 1);
+        free(mysql);
+    }
+}
+
+int mysql_ping(MYSQL *mysql)
+{
+    (void)mysql;
+
+    atomic_fetch_add(&mock_stats.pings, 1);
+
+    return 0;
+}
+
+unsigned int mysql_errno(MYSQL *mysql)
+{
+    (void)mysql;
+
+    return 0U;
+}
+
+unsigned long mysql_thread_id(MYSQL *mysql)
+{
+    return mysql->thread_id;
+}
+
+int mysql_get_socket(const MYSQL *mysql)
+{
+    (void)mysql;
+
+    return -1;
+}
+
+int mysql_real_query(MYSQL *mysql, const char *query, unsigned long length)
+{
+    (void)mysql;
+    (void)query;
+    (void)length;
+
+    return 0;
+}
+
+unsigned long mysql_real_escape_string(MYSQL *mysql, char *to,
+        const char *from, unsigned long length)
+{
+    unsigned long i;
+    unsigned long j = 0UL;
+
+    (void)mysql;
+
+    for (i = 0UL; i < length; i++) {
+        if (from[i] == '\'' || from[i] == '\\') {
+            to[j++] = '\\';
+        }
+        to[j++] = from[i];
+    }
+    to[j] = '\0';
+
+    return j;
+}
+
+unsigned int mysql_field_count(MYSQL *mysql)
+{
+    (void)mysql;
+
+    return 1U;
+}
+
+/* the result sets are always empty */
+MYSQL_RES *mysql_use_result(MYSQL *mysql)
+{
+    (void)mysql;
+
+    return calloc(1U, sizeof(MYSQL_RES));
+}
+
+MYSQL_ROW mysql_fetch_row(MYSQL_RES *res)
+{
+    (void)res;
+
+    return NULL;
+}
+
+unsigned long *mysql_fetch_lengths(MYSQL_RES *res)
+{
+    return res->lengths;
+}
+
+unsigned int mysql_num_fields(MYSQL_RES *res)
+{
+    (void)res;
+
+    return 1U;
+}
+
+void mysql_free_result(MYSQL_RES *res)
+{
+    free(res);
+}
+
+MYSQL_STMT *mysql_stmt_init(MYSQL *mysql)
+{
+    MYSQL_STMT *stmt;
+
+    stmt = calloc(1U, sizeof(*stmt));
+    if (stmt) {
+        stmt->mysql = mysql;
+    }
+
+    return stmt;
+}
+
+int mysql_stmt_prepare(MYSQL_STMT *stmt, const char *query,
+        unsigned long length)
+{
+    (void)stmt;
+    (void)query;
+    (void)length;
+
+    return 0;
+}
+
+my_bool mysql_stmt_bind_result(MYSQL_STMT *stmt, MYSQL_BIND *bind)
+{
+    (void)stmt;
+    (void)bind;
+
+    return 0;
+}
+
+int mysql_stmt_fetch(MYSQL_STMT *stmt)
+{
+    (void)stmt;
+
+    return MYSQL_NO_DATA;
+}
+
+unsigned int mysql_stmt_field_count(MYSQL_STMT *stmt)
+{
+    (void)stmt;
+
+    return 1U;
+}
+
+my_bool mysql_stmt_close(MYSQL_STMT *stmt)
+{
+    free(stmt);
+
+    return 0;
+}
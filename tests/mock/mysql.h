@@ -0,0 +1,115 @@
+/*
+ * cobalt-mysql-pool tests
+ *
+ * A mock of the parts of the MySQL client library which the pool uses,
+ * for the tests, the connections are plain memory and every query
+ * succeeds, the counters in `mock_stats` tell the tests what the pool
+ * did with them.
+ *
+ * https://github.com/0xebef/cobalt-mysql-pool
+ *
+ * License: LGPLv3 or later
+ *
+ * Copyright (c) 2026, 0xebef
+ */
+
+#ifndef COBALT_MYSQL_POOL_MOCK_MYSQL_H_INCLUDED
+#define COBALT_MYSQL_POOL_MOCK_MYSQL_H_INCLUDED
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include <stdatomic.h>
+
+/*
+ * there are no MYSQL_WAIT_ flags, so the pool is built without the
+ * non-blocking API and the reactor, like with the MySQL client library
+ */
+
+#define MYSQL_NO_DATA         (100)
+#define MYSQL_DATA_TRUNCATED  (101)
+
+typedef char my_bool;
+typedef char **MYSQL_ROW;
+
+typedef struct st_mysql MYSQL;
+typedef struct st_mysql_res MYSQL_RES;
+typedef struct st_mysql_stmt MYSQL_STMT;
+
+enum enum_field_types {
+    MYSQL_TYPE_LONGLONG = 8,
+    MYSQL_TYPE_STRING = 254
+};
+
+typedef struct st_mysql_bind {
+    unsigned long *length;
+    my_bool *is_null;
+    void *buffer;
+    my_bool *error;
+    enum enum_field_types buffer_type;
+    unsigned long buffer_length;
+    my_bool is_unsigned;
+} MYSQL_BIND;
+
+enum mysql_option {
+    MYSQL_OPT_CONNECT_TIMEOUT,
+    MYSQL_OPT_RECONNECT,
+    MYSQL_OPT_READ_TIMEOUT,
+    MYSQL_OPT_WRITE_TIMEOUT
+};
+
+/*
+ * what happened to the mock connections, `live` is the number of the
+ * open connections, a positive `connect_fail` fails that many of the
+ * next connection attempts
+ */
+struct mock_stats {
+    atomic_int live;
+    atomic_int connects;
+    atomic_int pings;
+    atomic_int connect_fail;
+};
+
+extern struct mock_stats mock_stats;
+
+int mysql_library_init(int argc, char **argv, char **groups);
+unsigned int mysql_thread_safe(void);
+my_bool mysql_thread_init(void);
+void mysql_thread_end(void);
+
+MYSQL *mysql_init(MYSQL *mysql);
+int mysql_options(MYSQL *mysql, enum mysql_option option, const void *arg);
+MYSQL *mysql_real_connect(MYSQL *mysql, const char *host, const char *user,
+        const char *passwd, const char *db, unsigned int port,
+        const char *unix_socket, unsigned long flags);
+my_bool mysql_autocommit(MYSQL *mysql, my_bool mode);
+void mysql_close(MYSQL *mysql);
+int mysql_ping(MYSQL *mysql);
+unsigned int mysql_errno(MYSQL *mysql);
+unsigned long mysql_thread_id(MYSQL *mysql);
+int mysql_get_socket(const MYSQL *mysql);
+
+int mysql_real_query(MYSQL *mysql, const char *query, unsigned long length);
+unsigned long mysql_real_escape_string(MYSQL *mysql, char *to,
+        const char *from, unsigned long length);
+unsigned int mysql_field_count(MYSQL *mysql);
+MYSQL_RES *mysql_use_result(MYSQL *mysql);
+MYSQL_ROW mysql_fetch_row(MYSQL_RES *res);
+unsigned long *mysql_fetch_lengths(MYSQL_RES *res);
+unsigned int mysql_num_fields(MYSQL_RES *res);
+void mysql_free_result(MYSQL_RES *res);
+
+MYSQL_STMT *mysql_stmt_init(MYSQL *mysql);
+int mysql_stmt_prepare(MYSQL_STMT *stmt, const char *query,
+        unsigned long length);
+my_bool mysql_stmt_bind_result(MYSQL_STMT *stmt, MYSQL_BIND *bind);
+int mysql_stmt_fetch(MYSQL_STMT *stmt);
+unsigned int mysql_stmt_field_count(MYSQL_STMT *stmt);
+my_bool mysql_stmt_close(MYSQL_STMT *stmt);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* COBALT_MYSQL_POOL_MOCK_MYSQL_H_INCLUDED */
@@ -0,0 +1,395 @@
+/*
+ * cobalt-mysql-pool tests
+ *
+ * The pool against the mock client library in tests/mock: concurrent
+ * borrowing and returning, closing while threads borrow, reaping of the
+ * idle connections and returning a connection twice.
+ *
+ * https://github.com/0xebef/cobalt-mysql-pool
+ *
+ * License: LGPLv3 or later
+ *
+ * Copyright (c) 2026, 0xebef
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <mysql.h>
+#include "cobalt-mysql-pool.h"
+
+/*
+ * the settings of the concurrency tests
+ */
+#define TEST_THREADS       (8U)
+#define TEST_ITERATIONS    (20000U)
+#define TEST_MAX_CONNS     (4U)
+
+/*
+ * how long (in milliseconds) the reaping may take at most
+ */
+#define TEST_REAP_MS       (2000U)
+
+/*
+ * fail the current test with a message if `cond` does not hold
+ */
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s failed (%s)\n", __FILE__, \
+                    __LINE__, #cond, db_error()); \
+            return -1; \
+        } \
+    } while (0)
+
+/*
+ * the state shared by a test and its threads
+ */
+struct test_state {
+    db_pool_t *pool;
+
+    /* 1 for every slot which is borrowed by a thread at the moment */
+    atomic_int held[TEST_MAX_CONNS];
+
+    /* set when a thread noticed an error */
+    atomic_int failed;
+
+    /* the borrowing threads stop when it is set */
+    atomic_int stop;
+
+    /* set after the pool was closed */
+    atomic_int closed;
+};
+
+/*
+ * create a pool of TEST_MAX_CONNS connections
+ *
+ * returns NULL on error
+ */
+static db_pool_t *pool_new(unsigned int min_conns, int thread_cache,
+        unsigned int idle_timeout_ms);
+
+/*
+ * get the time from the monotonic clock in milliseconds
+ */
+static uint64_t now_ms(void);
+
+/*
+ * borrow and return connections TEST_ITERATIONS times, checking that
+ * no other thread holds the same one
+ */
+static void *borrow_run(void *arg);
+
+/*
+ * borrow and return connections with a timeout until the pool is
+ * closed
+ */
+static void *acquire_run(void *arg);
+
+/*
+ * close the pool of the test
+ */
+static void *close_run(void *arg);
+
+/*
+ * the tests, they return zero on success or a negative value on error
+ */
+static int test_concurrent(int thread_cache);
+static int test_close_during_acquire(void);
+static int test_reap(int thread_cache);
+static int test_double_return(int thread_cache);
+
+int main(void)
+{
+    int failed = 0;
+
+    db_thread_init();
+
+    failed |= test_concurrent(0);
+    failed |= test_concurrent(1);
+    failed |= test_close_during_acquire();
+    failed |= test_reap(0);
+    failed |= test_reap(1);
+    failed |= test_double_return(0);
+    failed |= test_double_return(1);
+
+    db_thread_end();
+
+    if (failed) {
+        fprintf(stderr, "FAILED\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("all tests passed\n");
+
+    return EXIT_SUCCESS;
+}
+
+static db_pool_t *pool_new(unsigned int min_conns, int thread_cache,
+        unsigned int idle_timeout_ms)
+{
+    struct db_config config;
+
+    db_config_init(&config);
+    config.host = "localhost";
+    config.min_conns = min_conns;
+    config.max_conns = TEST_MAX_CONNS;
+    config.thread_cache = thread_cache;
+    config.idle_timeout_ms = idle_timeout_ms;
+    if (idle_timeout_ms) {
+        config.health_interval_ms = idle_timeout_ms / 2U;
+    }
+
+    return db_pool_create(NULL, &config);
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * UINT64_C(1000) +
+        (uint64_t)ts.tv_nsec / UINT64_C(1000000);
+}
+
+static void *borrow_run(void *arg)
+{
+    struct test_state *state = arg;
+    db_handle_t *handle;
+    unsigned int i;
+    unsigned int slot;
+
+    db_thread_init();
+
+    for (i = 0U; i < TEST_ITERATIONS; i++) {
+        handle = db_pool_get_handle(state->pool);
+        if (!handle) {
+            atomic_store(&state->failed, 1);
+            break;
+        }
+
+        slot = db_handle_slot(handle);
+        if (slot >= TEST_MAX_CONNS ||
+                atomic_exchange(&state->held[slot], 1)) {
+            /* given to two threads at once */
+            atomic_store(&state->failed, 1);
+            break;
+        }
+
+        if (i % 16U == 0U) {
+            sched_yield();
+        }
+
+        atomic_store(&state->held[slot], 0);
+
+        if (db_post_handle(handle) != 0) {
+            atomic_store(&state->failed, 1);
+            break;
+        }
+    }
+
+    db_thread_end();
+
+    return NULL;
+}
+
+static void *acquire_run(void *arg)
+{
+    struct test_state *state = arg;
+    db_handle_t *handle;
+
+    db_thread_init();
+
+    while (!atomic_load(&state->stop)) {
+        handle = db_pool_get_handle_timed(state->pool, UINT64_C(20000000));
+        if (!handle) {
+            continue;
+        }
+
+        /* nothing is handed out after the close returned */
+        if (atomic_load(&state->closed)) {
+            atomic_store(&state->failed, 1);
+        }
+
+        if (db_post_handle(handle) != 0) {
+            atomic_store(&state->failed, 1);
+        }
+    }
+
+    db_thread_end();
+
+    return NULL;
+}
+
+static void *close_run(void *arg)
+{
+    struct test_state *state = arg;
+
+    if (db_pool_close(state->pool) != 0) {
+        atomic_store(&state->failed, 1);
+    }
+    atomic_store(&state->closed, 1);
+
+    return NULL;
+}
+
+static int test_concurrent(int thread_cache)
+{
+    struct test_state state;
+    pthread_t threads[TEST_THREADS];
+    unsigned int i;
+
+    memset(&state, 0, sizeof(state));
+
+    state.pool = pool_new(2U, thread_cache, 0U);
+    CHECK(state.pool);
+
+    for (i = 0U; i < TEST_THREADS; i++) {
+        CHECK(pthread_create(&threads[i], NULL, borrow_run, &state) == 0);
+    }
+
+    for (i = 0U; i < TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    CHECK(!atomic_load(&state.failed));
+    CHECK(atomic_load(&mock_stats.live) <= (int)TEST_MAX_CONNS);
+    CHECK(db_pool_destroy(state.pool) == 0);
+    CHECK(atomic_load(&mock_stats.live) == 0);
+
+    printf("concurrent borrow/return (thread cache %d): ok\n",
+            thread_cache);
+
+    return 0;
+}
+
+static int test_close_during_acquire(void)
+{
+    struct test_state state;
+    pthread_t threads[TEST_THREADS];
+    pthread_t closer;
+    db_handle_t *handles[TEST_MAX_CONNS];
+    unsigned int i;
+
+    memset(&state, 0, sizeof(state));
+
+    state.pool = pool_new(TEST_MAX_CONNS, 0, 0U);
+    CHECK(state.pool);
+
+    /* the threads queue up for the connections held here */
+    for (i = 0U; i < TEST_MAX_CONNS; i++) {
+        handles[i] = db_pool_get_handle(state.pool);
+        CHECK(handles[i]);
+    }
+
+    for (i = 0U; i < TEST_THREADS; i++) {
+        CHECK(pthread_create(&threads[i], NULL, acquire_run, &state) == 0);
+    }
+
+    usleep(10000);
+
+    /* the close waits for the borrowed connections */
+    CHECK(pthread_create(&closer, NULL, close_run, &state) == 0);
+
+    usleep(10000);
+    CHECK(!atomic_load(&state.closed));
+
+    for (i = 0U; i < TEST_MAX_CONNS; i++) {
+        CHECK(db_post_handle(handles[i]) == 0);
+    }
+
+    pthread_join(closer, NULL);
+
+    CHECK(atomic_load(&state.closed));
+    CHECK(!db_pool_get_handle_timed(state.pool, 0U));
+
+    atomic_store(&state.stop, 1);
+    for (i = 0U; i < TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    CHECK(!atomic_load(&state.failed));
+    CHECK(db_pool_destroy(state.pool) == 0);
+    CHECK(atomic_load(&mock_stats.live) == 0);
+
+    printf("close during acquire: ok\n");
+
+    return 0;
+}
+
+static int test_reap(int thread_cache)
+{
+    db_pool_t *pool;
+    db_handle_t *handles[TEST_MAX_CONNS];
+    unsigned int i;
+    uint64_t start;
+
+    pool = pool_new(0U, thread_cache, 100U);
+    CHECK(pool);
+
+    for (i = 0U; i < TEST_MAX_CONNS; i++) {
+        handles[i] = db_pool_get_handle(pool);
+        CHECK(handles[i]);
+    }
+
+    for (i = 0U; i < TEST_MAX_CONNS; i++) {
+        CHECK(db_post_handle(handles[i]) == 0);
+    }
+
+    /* the connections are not closed before they are idle long enough */
+    start = now_ms();
+    usleep(20000);
+    CHECK(now_ms() - start >= 100U ||
+            atomic_load(&mock_stats.live) == (int)TEST_MAX_CONNS);
+
+    /* and then all of them are, also the one kept in the thread cache */
+    while (atomic_load(&mock_stats.live) > 0 &&
+            now_ms() - start < TEST_REAP_MS) {
+        usleep(10000);
+    }
+
+    CHECK(atomic_load(&mock_stats.live) == 0);
+    CHECK(db_pool_destroy(pool) == 0);
+
+    printf("idle reaping (thread cache %d): ok\n", thread_cache);
+
+    return 0;
+}
+
+static int test_double_return(int thread_cache)
+{
+    db_pool_t *pool;
+    db_handle_t *handle;
+
+    pool = pool_new(1U, thread_cache, 0U);
+    CHECK(pool);
+
+    handle = db_pool_get_handle(pool);
+    CHECK(handle);
+
+    CHECK(db_post_handle(handle) == 0);
+    CHECK(db_post_handle(handle) != 0);
+
+    /* the pool is still usable and has one connection only */
+    handle = db_pool_get_handle(pool);
+    CHECK(handle);
+    CHECK(db_post_handle(handle) == 0);
+    CHECK(atomic_load(&mock_stats.live) == 1);
+
+    CHECK(db_pool_destroy(pool) == 0);
+    CHECK(atomic_load(&mock_stats.live) == 0);
+
+    printf("double return (thread cache %d): ok\n", thread_cache);
+
+    return 0;
+}